@@ -0,0 +1,556 @@
+/*
+ * memcheck - C++ debug utility for tracking objects lifetime
+ *
+ * Copyright (C) 2017 Maciej Suminski <orson@orson.net.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// memcheck-analyze - reports on logs written by event_stream, outside
+// of the tracked process
+//
+// usage: memcheck-analyze [-t seconds] [-n top] [-j threads] [-d debug_dir] log
+//
+//   -t  rebuilds the set of existing objects at the given time since the
+//       beginning of the log, instead of its end
+//   -n  number of creation sites shown in each report (default 10)
+//   -j  number of aggregating threads (default: all cores)
+//   -d  directory with modules or their debug information, see memcheck-symbolize
+//
+// The log is read once, events are distributed between threads by object
+// address, so each thread sees the whole lifetime of its objects. Memory
+// usage depends on the number of objects existing at the same time and the
+// number of stack traces, not on the log size. The peak number of existing
+// objects is summed over the threads, so with -j above 1 it is an upper bound.
+
+#include "memcheck.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef event_stream_reader::event event;
+
+// hands batches of events over to an aggregating thread,
+// the reader waits if the thread falls behind
+class batch_queue
+{
+public:
+    batch_queue() : _closed(false)
+    {
+    }
+
+    void push(std::vector<event>&& batch)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _not_full.wait(lock, [this]() { return _batches.size() < max_batches; });
+        _batches.push_back(std::move(batch));
+        _not_empty.notify_one();
+    }
+
+    // returns false when the queue is closed and empty
+    bool pop(std::vector<event>& batch)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _not_empty.wait(lock, [this]() { return !_batches.empty() || _closed; });
+
+        if(_batches.empty())
+            return false;
+
+        batch = std::move(_batches.front());
+        _batches.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _closed = true;
+        _not_empty.notify_one();
+    }
+
+private:
+    static const size_t max_batches = 4;
+
+    std::mutex _lock;
+    std::condition_variable _not_empty, _not_full;
+    std::deque<std::vector<event>> _batches;
+    bool _closed;
+};
+
+// statistics of a creation site, identified by type and stack trace
+struct site_stats
+{
+    site_stats() : created(0), destroyed(0), created_bytes(0), live(0), live_bytes(0),
+        lifetime(0)
+    {
+    }
+
+    void add(const site_stats& other)
+    {
+        created += other.created;
+        destroyed += other.destroyed;
+        created_bytes += other.created_bytes;
+        live += other.live;
+        live_bytes += other.live_bytes;
+        lifetime += other.lifetime;
+    }
+
+    uint64_t created;
+    uint64_t destroyed;
+    uint64_t created_bytes;
+    uint64_t live;
+    uint64_t live_bytes;
+    uint64_t lifetime;      // sum of lifetimes of the destroyed objects, in ticks
+};
+
+static uint64_t site_key(uint32_t type, uint32_t trace)
+{
+    return uint64_t(type) << 32 | trace;
+}
+
+// lifetimes are counted in power of two ranges of ticks
+static const int histogram_size = 64;
+
+// aggregates events of the objects assigned to it
+class aggregator
+{
+public:
+    struct live_info
+    {
+        uint32_t type;
+        uint32_t trace;
+        uint64_t time;
+        uint64_t size;
+    };
+
+    aggregator() : unmatched(0), peak(0)
+    {
+        std::fill(histogram, histogram + histogram_size, 0);
+    }
+
+    void run(batch_queue& queue)
+    {
+        std::vector<event> batch;
+
+        while(queue.pop(batch))
+        {
+            for(const event& ev : batch)
+                process(ev.created, ev.data);
+        }
+
+        finish();
+    }
+
+    // events of an object come in order only if they were written by the same
+    // thread, so they are matched by their times
+    void process(bool created, const stream_event& ev)
+    {
+        if(created)
+        {
+            auto early = destroyed_early.find(ev.obj);
+
+            // the object was destroyed by a thread that wrote its events first
+            if(early != destroyed_early.end() && early->second >= ev.time)
+            {
+                live_info info = { ev.type, ev.trace, ev.time, ev.size };
+                add(info);
+                remove(info, early->second);
+                destroyed_early.erase(ev.obj);
+                return;
+            }
+
+            // the previous object at the address is still waiting for its
+            // destruction event; if there is an older one, it was destroyed
+            // without being logged (e.g. it was not sampled)
+            auto it = live.find(ev.obj);
+
+            if(it != live.end())
+            {
+                if(displaced.find(ev.obj) != displaced.end())
+                    forget(displaced, ev.obj);
+
+                displaced[ev.obj] = it->second;
+            }
+
+            live_info& info = live[ev.obj];
+            info.type = ev.type;
+            info.trace = ev.trace;
+            info.time = ev.time;
+            info.size = ev.size;
+            add(info);
+
+            // displaced objects may still exist, their destruction comes later
+            peak = std::max<uint64_t>(peak, live.size() + displaced.size());
+            return;
+        }
+
+        auto prev = displaced.find(ev.obj);
+
+        if(prev != displaced.end() && prev->second.time <= ev.time)
+        {
+            auto it = live.find(ev.obj);
+
+            // the destruction precedes the current object
+            if(it == live.end() || it->second.time > ev.time)
+            {
+                remove(prev->second, ev.time);
+                displaced.erase(ev.obj);
+                return;
+            }
+        }
+
+        auto it = live.find(ev.obj);
+
+        if(it == live.end() || it->second.time > ev.time)
+        {
+            // the construction may come later; an older unmatched destruction
+            // is given up
+            auto early = destroyed_early.find(ev.obj);
+
+            if(early != destroyed_early.end())
+                ++unmatched;
+
+            destroyed_early[ev.obj] = ev.time;
+            return;
+        }
+
+        remove(it->second, ev.time);
+        live.erase(ev.obj);
+    }
+
+    // called when all events have been processed
+    void finish()
+    {
+        // destructions of the displaced objects have not been logged
+        while(displaced.begin() != displaced.end())
+            forget(displaced, displaced.begin()->first);
+
+        unmatched += destroyed_early.size();
+        destroyed_early.clear();
+    }
+
+    flat_table<uint64_t, live_info> live;
+    flat_table<uint64_t, site_stats> sites;
+    uint64_t histogram[histogram_size];
+    uint64_t unmatched;         // destroyed objects that were not created in the log
+    uint64_t peak;              // maximum number of existing objects
+
+private:
+    void add(const live_info& info)
+    {
+        site_stats& site = sites[site_key(info.type, info.trace)];
+        ++site.created;
+        site.created_bytes += info.size;
+        ++site.live;
+        site.live_bytes += info.size;
+    }
+
+    void remove(const live_info& info, uint64_t time)
+    {
+        uint64_t lifetime = time > info.time ? time - info.time : 0;
+        site_stats& site = sites[site_key(info.type, info.trace)];
+        ++site.destroyed;
+        --site.live;
+        site.live_bytes -= info.size;
+        site.lifetime += lifetime;
+        ++histogram[lifetime ? 63 - __builtin_clzll(lifetime) : 0];
+    }
+
+    void forget(flat_table<uint64_t, live_info>& table, uint64_t obj)
+    {
+        const live_info& info = table.find(obj)->second;
+        site_stats& site = sites[site_key(info.type, info.trace)];
+        --site.live;
+        site.live_bytes -= info.size;
+        table.erase(obj);
+    }
+
+    // objects replaced by another one at the same address before
+    // their destruction has been seen
+    flat_table<uint64_t, live_info> displaced;
+
+    // destructions seen before the construction, with their times
+    flat_table<uint64_t, uint64_t> destroyed_early;
+};
+
+static std::string format_time(double seconds)
+{
+    static const char* units[] = { "s", "ms", "us", "ns" };
+    int unit = 0;
+
+    while(unit < 3 && seconds != 0.0 && seconds < 1.0)
+    {
+        seconds *= 1000.0;
+        ++unit;
+    }
+
+    std::ostringstream out;
+    out << std::setprecision(3) << seconds << " " << units[unit];
+    return out.str();
+}
+
+struct site
+{
+    uint32_t type;
+    uint32_t trace;
+    site_stats stats;
+};
+
+static void show_trace(const event_stream_reader& reader, offline_symbolizer& symbolizer,
+        uint32_t trace)
+{
+    auto it = reader.traces().find(trace);
+
+    if(it == reader.traces().end())
+        return;
+
+    symbolizer.write_trace(std::cout, it->second, "    ");
+}
+
+static const std::string& type_name(const event_stream_reader& reader, uint32_t type)
+{
+    static const std::string unknown("??");
+    auto it = reader.types().find(type);
+    return it != reader.types().end() ? it->second : unknown;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string debug_dir;
+    double cut_time = -1.0;
+    size_t top = 10;
+    unsigned num_threads = std::max(1U, std::thread::hardware_concurrency());
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:n:j:d:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': cut_time = strtod(optarg, nullptr); break;
+            case 'n': top = strtoul(optarg, nullptr, 10); break;
+            case 'j': num_threads = std::max(1UL, strtoul(optarg, nullptr, 10)); break;
+            case 'd': debug_dir = optarg; break;
+
+            default:
+                std::cerr << "usage: " << argv[0]
+                          << " [-t seconds] [-n top] [-j threads] [-d debug_dir] log" << std::endl;
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " [-t seconds] [-n top] [-j threads] [-d debug_dir] log" << std::endl;
+        return 1;
+    }
+
+    std::vector<char> file_buffer(1 << 20);
+    std::ifstream file;
+    file.rdbuf()->pubsetbuf(file_buffer.data(), file_buffer.size());
+    file.open(argv[optind], std::ios::binary);
+
+    if(!file)
+    {
+        std::cerr << "cannot open " << argv[optind] << std::endl;
+        return 1;
+    }
+
+    event_stream_reader reader(file);
+
+    if(!reader.valid())
+    {
+        std::cerr << argv[optind] << " is not a memcheck event log" << std::endl;
+        return 1;
+    }
+
+    std::vector<aggregator> aggregators(num_threads);
+    std::vector<batch_queue> queues(num_threads);
+    std::vector<std::vector<event>> batches(num_threads);
+    std::vector<std::thread> threads;
+    const size_t batch_size = 8192;
+
+    for(unsigned i = 0; i < num_threads; ++i)
+        threads.emplace_back([&aggregators, &queues, i]() { aggregators[i].run(queues[i]); });
+
+    uint64_t num_events = 0, created = 0, destroyed = 0;
+    uint64_t start_time = 0, first_time = 0, last_time = 0;
+    event ev;
+
+    while(reader.next(ev))
+    {
+        if(num_events == 0 && start_time == 0)
+            start_time = first_time = last_time = ev.data.time;
+
+        // the buffers of threads are interleaved, so the whole log is read
+        if(cut_time >= 0.0 && reader.frequency() && ev.data.time > start_time
+                && ev.data.time - start_time > cut_time * reader.frequency())
+            continue;
+
+        ++num_events;
+
+        first_time = std::min(first_time, ev.data.time);
+        last_time = std::max(last_time, ev.data.time);
+
+        if(ev.created)
+            ++created;
+        else
+            ++destroyed;
+
+        // all events of an object go to the same thread
+        size_t idx = (ev.data.obj * 0x9e3779b97f4a7c15ULL >> 32) % num_threads;
+        std::vector<event>& batch = batches[idx];
+
+        if(batch.empty())
+            batch.reserve(batch_size);
+
+        batch.push_back(ev);
+
+        if(batch.size() == batch_size)
+            queues[idx].push(std::move(batch));
+    }
+
+    for(unsigned i = 0; i < num_threads; ++i)
+    {
+        if(!batches[i].empty())
+            queues[i].push(std::move(batches[i]));
+
+        queues[i].close();
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    // merge the results of all threads
+    flat_table<uint64_t, site_stats> merged;
+    uint64_t histogram[histogram_size] = { 0 };
+    uint64_t unmatched = 0, live = 0, live_bytes = 0, peak = 0;
+
+    for(aggregator& agg : aggregators)
+    {
+        for(const auto& entry : agg.sites)
+            merged[entry.first].add(entry.second);
+
+        for(int i = 0; i < histogram_size; ++i)
+            histogram[i] += agg.histogram[i];
+
+        unmatched += agg.unmatched;
+        peak += agg.peak;
+        live += agg.live.size();
+
+        for(const auto& obj : agg.live)
+            live_bytes += obj.second.size;
+    }
+
+    std::vector<site> sites;
+
+    for(const auto& entry : merged)
+    {
+        site s = { uint32_t(entry.first >> 32), uint32_t(entry.first), entry.second };
+        sites.push_back(s);
+    }
+
+    double frequency = reader.frequency() ? reader.frequency() : 1e9;
+    double duration = (last_time - first_time) / frequency;
+    offline_symbolizer symbolizer(debug_dir);
+
+    for(size_t i = 0; i < reader.modules().size(); ++i)
+    {
+        const event_stream_reader::module& mod = reader.modules()[i];
+        symbolizer.add_module(i, mod.path, mod.build_id);
+    }
+
+    std::cout << "events: " << num_events << " in " << format_time(duration) << std::endl;
+    std::cout << "created " << created << ", destroyed " << destroyed
+              << ", existing " << live << " (" << live_bytes << " bytes), peak " << peak << std::endl;
+
+    if(duration > 0.0)
+    {
+        std::cout << "churn: " << std::setprecision(3) << created / duration << " created/s, "
+                  << destroyed / duration << " destroyed/s" << std::endl;
+    }
+
+    if(unmatched)
+        std::cout << unmatched << " destroyed objects were not created in the log" << std::endl;
+
+    // objects still existing, the sites holding the most memory first
+    std::sort(sites.begin(), sites.end(), [](const site& a, const site& b) {
+        return a.stats.live_bytes > b.stats.live_bytes;
+    });
+
+    std::cout << std::endl << "existing objects at " << format_time(duration)
+              << ", by bytes:" << std::endl;
+
+    for(size_t i = 0; i < sites.size() && i < top && sites[i].stats.live; ++i)
+    {
+        const site& s = sites[i];
+        std::cout << s.stats.live_bytes << " bytes in " << s.stats.live << " objects of "
+                  << type_name(reader, s.type) << " created at" << std::endl;
+        show_trace(reader, symbolizer, s.trace);
+    }
+
+    // the busiest sites
+    std::sort(sites.begin(), sites.end(), [](const site& a, const site& b) {
+        return a.stats.created > b.stats.created;
+    });
+
+    std::cout << std::endl << "top creation sites:" << std::endl;
+
+    for(size_t i = 0; i < sites.size() && i < top; ++i)
+    {
+        const site& s = sites[i];
+        std::cout << s.stats.created << " objects of " << type_name(reader, s.type) << ", "
+                  << s.stats.created_bytes << " bytes";
+
+        if(duration > 0.0)
+            std::cout << ", " << std::setprecision(3) << s.stats.created / duration << "/s";
+
+        if(s.stats.destroyed)
+        {
+            std::cout << ", mean lifetime "
+                      << format_time(s.stats.lifetime / frequency / s.stats.destroyed);
+        }
+
+        std::cout << std::endl;
+        show_trace(reader, symbolizer, s.trace);
+    }
+
+    std::cout << std::endl << "lifetimes of destroyed objects:" << std::endl;
+    uint64_t max_count = *std::max_element(histogram, histogram + histogram_size);
+
+    for(int i = 0; i < histogram_size; ++i)
+    {
+        if(!histogram[i])
+            continue;
+
+        std::cout << std::setw(10) << ("< " + format_time((2.0 * (1ULL << i)) / frequency))
+                  << std::setw(12) << histogram[i] << " "
+                  << std::string(50 * histogram[i] / max_count, '#') << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * memcheck - C++ debug utility for tracking objects lifetime
+ *
+ * Copyright (C) 2017 Maciej Suminski <orson@orson.net.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// memcheck-postmortem - lists objects that existed when a process died,
+// read from the file written by mapped_registry
+//
+// usage: memcheck-postmortem [-n count] [-d debug_dir] file
+//
+//   -n  shows only the given number of the biggest objects
+//   -d  directory with modules or their debug information, see memcheck-symbolize
+
+#include "memcheck.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char* argv[])
+{
+    std::string debug_dir;
+    size_t count = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:d:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': count = strtoul(optarg, nullptr, 10); break;
+            case 'd': debug_dir = optarg; break;
+
+            default:
+                std::cerr << "usage: " << argv[0] << " [-n count] [-d debug_dir] file" << std::endl;
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        std::cerr << "usage: " << argv[0] << " [-n count] [-d debug_dir] file" << std::endl;
+        return 1;
+    }
+
+    mapped_registry_reader reader(argv[optind]);
+
+    if(!reader.valid())
+    {
+        std::cerr << argv[optind] << " is not a memcheck registry" << std::endl;
+        return 1;
+    }
+
+    const event_stream_reader& records = reader.records();
+    offline_symbolizer symbolizer(debug_dir);
+
+    for(size_t i = 0; i < records.modules().size(); ++i)
+        symbolizer.add_module(i, records.modules()[i].path, records.modules()[i].build_id);
+
+    // the biggest objects first
+    std::vector<mapped_registry_reader::object> objs = reader.objects();
+    std::stable_sort(objs.begin(), objs.end(),
+            [](const mapped_registry_reader::object& a, const mapped_registry_reader::object& b) {
+                return a.size > b.size;
+            });
+
+    if(count && objs.size() > count)
+        objs.resize(count);
+
+    std::cout << "process " << reader.pid() << ": " << reader.objects().size()
+              << " existing objects" << std::endl;
+
+    if(reader.dropped())
+        std::cout << reader.dropped() << " objects did not fit in the registry" << std::endl;
+
+    std::cout << std::endl;
+    double frequency = records.frequency() ? records.frequency() : 1e9;
+
+    for(const auto& obj : objs)
+    {
+        auto type = records.types().find(obj.type);
+
+        std::cout << "construction stack trace for "
+                  << (type != records.types().end() ? type->second : "??")
+                  << " 0x" << std::hex << obj.obj << std::dec << " (" << obj.size
+                  << " bytes), created " << std::setprecision(3) << obj.time / frequency
+                  << " s after start" << std::endl;
+
+        auto trace = records.traces().find(obj.trace);
+
+        if(trace == records.traces().end())
+        {
+            std::cout << std::endl;
+            continue;
+        }
+
+        symbolizer.write_trace(std::cout, trace->second);
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
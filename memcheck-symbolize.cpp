@@ -0,0 +1,154 @@
+/*
+ * memcheck - C++ debug utility for tracking objects lifetime
+ *
+ * Copyright (C) 2017 Maciej Suminski <orson@orson.net.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// memcheck-symbolize - turns reports written by memcheck<T>::dump()
+// into readable stack traces, outside of the tracked process
+//
+// usage: memcheck-symbolize [-d debug_dir] [report]
+//
+// Modules are looked up in debug_dir by their build-id
+// (debug_dir/.build-id/xx/yyyy.debug) or file name, then at the path
+// recorded in the report. Symbols and source lines are read with the same
+// ELF and DWARF readers memcheck uses in the tracked process
+// (see offline_symbolizer).
+
+#include "memcheck.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct object
+{
+    std::string addr;
+    unsigned long trace;
+    unsigned long size;     // 0 if not reported
+};
+
+int main(int argc, char* argv[])
+{
+    std::string debug_dir;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:")) != -1)
+    {
+        if(opt == 'd')
+        {
+            debug_dir = optarg;
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [-d debug_dir] [report]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::ifstream file;
+
+    if(optind < argc)
+    {
+        file.open(argv[optind]);
+
+        if(!file)
+        {
+            std::cerr << "cannot open " << argv[optind] << std::endl;
+            return 1;
+        }
+    }
+
+    std::istream& in = optind < argc ? file : std::cin;
+    offline_symbolizer symbolizer(debug_dir);
+    std::map<unsigned long, std::vector<offline_symbolizer::frame>> traces;
+    std::vector<object> objs;
+    std::string type, line;
+
+    while(std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+
+        if(kind == "type")
+        {
+            std::getline(fields >> std::ws, type);
+        }
+        else if(kind == "module")
+        {
+            int idx;
+            std::string base, build_id, path;
+
+            fields >> idx >> base >> build_id;
+            std::getline(fields >> std::ws, path);
+
+            if(build_id == "-")
+                build_id.clear();
+
+            symbolizer.add_module(idx, path, build_id);
+        }
+        else if(kind == "trace")
+        {
+            unsigned long id;
+            std::string token;
+            std::vector<offline_symbolizer::frame>& tr = traces[(fields >> id, id)];
+
+            while(fields >> token)
+            {
+                size_t sep = token.find(':');
+                offline_symbolizer::frame fr;
+
+                fr.module = strtol(token.substr(0, sep).c_str(), nullptr, 10);
+                fr.offset = strtoul(token.substr(sep + 1).c_str(), nullptr, 16);
+                tr.push_back(fr);
+            }
+        }
+        else if(kind == "object")
+        {
+            object obj = { "", 0, 0 };
+
+            fields >> obj.addr >> obj.trace >> obj.size;
+            objs.push_back(obj);
+        }
+    }
+
+    // the biggest objects first
+    std::stable_sort(objs.begin(), objs.end(),
+            [](const object& a, const object& b) { return a.size > b.size; });
+
+    for(const auto& obj : objs)
+    {
+        std::cout << "construction stack trace for " << type << " " << obj.addr;
+
+        if(obj.size)
+            std::cout << " (" << obj.size << " bytes)";
+
+        std::cout << std::endl;
+
+        symbolizer.write_trace(std::cout, traces[obj.trace]);
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
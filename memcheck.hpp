@@ -23,394 +23,6728 @@
 #include <dlfcn.h>
 #include <execinfo.h>
 #include <cxxabi.h>
+#include <fcntl.h>
+#include <link.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
-// the following class comes from:
-// https://en.wikibooks.org/wiki/Linux_Applications_Debugging_Techniques/The_call_stack
-class call_stack
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// open addressing hash table with keys compared by value (pointers and
+// integers). Probing is linear, but control bytes are scanned a group at
+// a time (with SSE2 when available), so a lookup usually touches one or two
+// cache lines. Erasing shifts the following entries back instead of leaving
+// tombstones, so the table does not degrade under heavy create/destroy churn.
+template<typename K, typename V>
+class flat_table
 {
 public:
-    static const int depth = 40;
-    typedef std::array<void *, depth> stack_t;
+    struct slot
+    {
+        K first;
+        V second;
+    };
 
-    class const_iterator;
-    class frame
+    class iterator
     {
     public:
-        frame(void *addr = 0)
-                : _addr(0)
-                , _binary_name(0)
-                , _func_name(0)
-                , _demangled_func_name(0)
-                , _delta_sign('+')
-                , _delta(0L)
-                , _source_file_name(0)
-                , _line_number(0)
-                , _dladdr_ret(false)
+        iterator(const flat_table* table, size_t idx)
+            : _table(table), _idx(idx)
         {
-            resolve(addr);
+            skip_empty();
         }
 
-        // frame(stack_t::iterator& it) : frame(*it) {} //C++0x
-        frame(stack_t::const_iterator const& it)
-                : _addr(0)
-                , _binary_name(0)
-                , _func_name(0)
-                , _demangled_func_name(0)
-                , _delta_sign('+')
-                , _delta(0L)
-                , _source_file_name(0)
-                , _line_number(0)
-                , _dladdr_ret(false)
-        {
-            resolve(*it);
-        }
+        bool operator==(const iterator& other) const { return _idx == other._idx; }
+        bool operator!=(const iterator& other) const { return _idx != other._idx; }
 
-        frame(frame const& other)
-        {
-            resolve(other._addr);
-        }
+        slot& operator*() const  { return _table->_slots[_idx]; }
+        slot* operator->() const { return &_table->_slots[_idx]; }
 
-        frame& operator=(frame const& other)
+        iterator& operator++()
         {
-            if (this != &other) {
-                resolve(other._addr);
-            }
+            ++_idx;
+            skip_empty();
             return *this;
         }
 
-        ~frame()
+    private:
+        void skip_empty()
         {
-            resolve(0);
+            while(_idx < _table->capacity() && _table->_ctrl[_idx] == ctrl_empty)
+                ++_idx;
         }
 
-        __attribute__((noinline))
-        std::string as_string() const
-        {
-            std::ostringstream s;
-            s << "[" << std::hex << _addr << "] "
-              << demangled_function()
-              << " (" << binary_file() << _delta_sign << "0x" << std::hex << _delta << ")"
-              << " in " << source_file() << ":" << line_number();
-            return s.str();
-        }
+        const flat_table* _table;
+        size_t _idx;
+    };
 
-        __attribute__((noinline))
-        const void* addr() const               { return _addr; }
+    typedef iterator const_iterator;
 
-        __attribute__((noinline))
-        const char* binary_file() const        { return safe(_binary_name); }
+    flat_table()
+        : _ctrl(nullptr), _slots(nullptr), _mask(0), _size(0), _growth_left(0)
+    {
+    }
 
-        __attribute__((noinline))
-        const char* function() const           { return safe(_func_name); }
+    flat_table(const flat_table&) = delete;
+    flat_table& operator=(const flat_table&) = delete;
 
-        __attribute__((noinline))
-        const char* demangled_function() const { return safe(_demangled_func_name); }
+    ~flat_table()
+    {
+        release();
+    }
 
-        __attribute__((noinline))
-        char        delta_sign() const         { return _delta_sign; }
+    size_t size() const      { return _size; }
+    bool empty() const       { return _size == 0; }
+    size_t capacity() const  { return _slots ? _mask + 1 : 0; }
 
-        __attribute__((noinline))
-        long        delta() const              { return _delta; }
+    // memory used by the table, in bytes
+    size_t memory() const
+    {
+        return _slots ? capacity() * (sizeof(slot) + 1) + group_width - 1 : 0;
+    }
 
-        __attribute__((noinline))
-        const char* source_file() const        { return safe(_source_file_name); }
+    iterator begin() const   { return iterator(this, 0); }
+    iterator end() const     { return iterator(this, capacity()); }
 
-        __attribute__((noinline))
-        int         line_number() const        { return  _line_number; }
+    // make room for at least n entries, so they can be inserted without rehashing
+    void reserve(size_t n)
+    {
+        size_t cap = group_width;
 
-    private:
+        while(max_load(cap) < n)
+            cap *= 2;
 
-        const char* safe(const char* p) const { return p ? p : "??"; }
+        if(cap > capacity())
+            rehash(cap);
+    }
 
-        friend class const_iterator; // To call resolve()
+    iterator find(const K& key) const
+    {
+        size_t idx = lookup(key);
+        return iterator(this, idx == npos ? capacity() : idx);
+    }
 
-        void resolve(const void* addr)
-        {
-            if (_addr == addr)
-                return;
+    V& operator[](const K& key)
+    {
+        size_t idx = lookup(key);
 
-            _addr = addr;
-            _dladdr_ret = false;
-            _binary_name = 0;
-            _func_name = 0;
-            if (_demangled_func_name) {
-                free(_demangled_func_name);
-                _demangled_func_name = 0;
-            }
-            _delta_sign = '+';
-            _delta = 0L;
-            _source_file_name = 0;
-            _line_number = 0;
-
-            if (!_addr)
-                return;
+        if(idx != npos)
+            return _slots[idx].second;
 
-            _dladdr_ret = (::dladdr(_addr, &_info) != 0);
-            if (_dladdr_ret)
-            {
-                _binary_name = safe(_info.dli_fname);
-                _func_name   = safe(_info.dli_sname);
-                _delta_sign  = (_addr >=  _info.dli_saddr) ? '+' : '-';
-                _delta = ::labs(static_cast<const char *>(_addr) - static_cast<const char *>(_info.dli_saddr));
+        if(_growth_left == 0)
+            rehash(_slots ? capacity() * 2 : group_width);
 
-                 int status = 0;
-                 _demangled_func_name = abi::__cxa_demangle(_func_name, 0, 0, &status);
-            }
-        }
+        uint64_t h = hash(key);
+        idx = find_empty(h >> 7);
+        set_ctrl(idx, h & 0x7f);
+        new(&_slots[idx]) slot{key, V()};
+        ++_size;
+        --_growth_left;
 
-    private:
+        return _slots[idx].second;
+    }
 
-        const void* _addr;
-        const char* _binary_name;
-        const char* _func_name;
-        char*       _demangled_func_name;
-        char        _delta_sign;
-        long        _delta;
-        const char* _source_file_name; //TODO: libbfd
-        int         _line_number;
-
-        Dl_info     _info;
-        bool        _dladdr_ret;
-    }; //frame
+    bool erase(const K& key)
+    {
+        size_t idx = lookup(key);
+
+        if(idx == npos)
+            return false;
 
+        erase_at(idx);
+        return true;
+    }
 
-    class const_iterator
-            : public std::iterator<std::bidirectional_iterator_tag, ptrdiff_t>
+    void clear()
     {
-    public:
+        release();
+    }
 
-        const_iterator(stack_t::const_iterator const& it)
-                : _frame(it)
-                , _it(it)
-        {}
+    void swap(flat_table& other)
+    {
+        std::swap(_ctrl, other._ctrl);
+        std::swap(_slots, other._slots);
+        std::swap(_mask, other._mask);
+        std::swap(_size, other._size);
+        std::swap(_growth_left, other._growth_left);
+    }
 
-        bool operator==(const const_iterator& other) const
-        {
-            return _frame.addr() == other._frame.addr();
-        }
+private:
+    static const size_t group_width = 16;
+    static const size_t npos = size_t(-1);
+    static const uint8_t ctrl_empty = 0x80;  // full slots keep 7 bits of the hash
 
-        bool operator!=(const const_iterator& x) const
-        {
-            return !(*this == x);
-        }
+    static size_t max_load(size_t cap) { return cap - cap / 8; }
 
-        const frame& operator*() const
-        {
-            return _frame;
-        }
-        const frame* operator->() const
-        {
-            return &_frame;
-        }
+    static uint64_t mix(uint64_t x)
+    {
+        x *= 0x9e3779b97f4a7c15ULL;
+        return x ^ (x >> 32);
+    }
 
-        const_iterator& operator++()
+    static uint64_t hash(const void* key) { return mix(reinterpret_cast<uintptr_t>(key)); }
+    static uint64_t hash(uint64_t key)    { return mix(key); }
+
+    // bit masks of slots in the group starting at pos that match h2 or are empty
+    struct group
+    {
+        group(const uint8_t* ctrl)
         {
-            ++_it;
-            _frame.resolve(*_it);
-            return *this;
+#ifdef __SSE2__
+            _ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+            memcpy(_ctrl, ctrl, group_width);
+#endif
         }
-        const_iterator operator++(int)
+
+        uint32_t match(uint8_t h2) const
         {
-            const_iterator tmp = *this;
-            ++_it;
-            _frame.resolve(*_it);
-            return tmp;
+#ifdef __SSE2__
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_ctrl, _mm_set1_epi8(h2)));
+#else
+            uint32_t mask = 0;
+            for(size_t i = 0; i < group_width; ++i)
+                mask |= uint32_t(_ctrl[i] == h2) << i;
+            return mask;
+#endif
         }
 
-        const_iterator& operator--()
+        uint32_t match_empty() const
         {
-            --_it;
-            _frame.resolve(*_it);
-            return *this;
+#ifdef __SSE2__
+            return _mm_movemask_epi8(_ctrl);
+#else
+            return match(ctrl_empty);
+#endif
         }
-        const_iterator operator--(int)
+
+#ifdef __SSE2__
+        __m128i _ctrl;
+#else
+        uint8_t _ctrl[group_width];
+#endif
+    };
+
+    size_t lookup(const K& key) const
+    {
+        if(!_slots)
+            return npos;
+
+        uint64_t h = hash(key);
+        uint8_t h2 = h & 0x7f;
+        size_t pos = (h >> 7) & _mask;
+
+        // the key, if present, lies between its home slot and the first
+        // empty slot; there is always at least one empty slot
+        while(true)
         {
-            const_iterator tmp = *this;
-            --_it;
-            _frame.resolve(*_it);
-            return tmp;
+            group g(_ctrl + pos);
+
+            for(uint32_t m = g.match(h2); m; m &= m - 1)
+            {
+                size_t idx = (pos + __builtin_ctz(m)) & _mask;
+
+                if(_slots[idx].first == key)
+                    return idx;
+            }
+
+            if(g.match_empty())
+                return npos;
+
+            pos = (pos + group_width) & _mask;
         }
+    }
 
-    private:
-        const_iterator();
+    size_t find_empty(uint64_t h1) const
+    {
+        size_t pos = h1 & _mask;
 
-        frame                    _frame;
-        stack_t::const_iterator  _it;
-    }; //const_iterator
+        while(true)
+        {
+            uint32_t m = group(_ctrl + pos).match_empty();
 
+            if(m)
+                return (pos + __builtin_ctz(m)) & _mask;
 
-    public:
-    call_stack() : _num_frames(0)
+            pos = (pos + group_width) & _mask;
+        }
+    }
+
+    // the first group_width - 1 control bytes are mirrored after the last
+    // one, so a group may be loaded at any position without wrapping
+    void set_ctrl(size_t idx, uint8_t value)
     {
-        _num_frames = ::backtrace(_stack.data(), depth);
-        assert(_num_frames >= 0 && _num_frames <= depth);
+        _ctrl[idx] = value;
+
+        if(idx < group_width - 1)
+            _ctrl[idx + _mask + 1] = value;
     }
 
-    std::string as_string()
+    void erase_at(size_t hole)
     {
-        std::string s;
-        const_iterator itEnd = end();
-        for (const_iterator it = begin(); it != itEnd; ++it) {
-            s += it->as_string();
-            s += "\n";
+        _slots[hole].~slot();
+
+        // backward shift: move every following entry of the probe run that
+        // may live at the hole, so lookups never have to skip deleted slots
+        for(size_t idx = (hole + 1) & _mask; _ctrl[idx] != ctrl_empty; idx = (idx + 1) & _mask)
+        {
+            size_t home = (hash(_slots[idx].first) >> 7) & _mask;
+
+            if(((idx - home) & _mask) >= ((idx - hole) & _mask))
+            {
+                new(&_slots[hole]) slot(std::move(_slots[idx]));
+                _slots[idx].~slot();
+                set_ctrl(hole, _ctrl[idx]);
+                hole = idx;
+            }
         }
-        return s;
+
+        set_ctrl(hole, ctrl_empty);
+        --_size;
+        ++_growth_left;
     }
 
-    virtual ~call_stack()
+    void rehash(size_t cap)
     {
+        uint8_t* old_ctrl = _ctrl;
+        slot* old_slots = _slots;
+        size_t old_cap = capacity();
+
+        _ctrl = static_cast<uint8_t*>(::operator new(cap + group_width - 1));
+        _slots = static_cast<slot*>(::operator new(cap * sizeof(slot)));
+        _mask = cap - 1;
+        _growth_left = max_load(cap) - _size;
+        memset(_ctrl, ctrl_empty, cap + group_width - 1);
+
+        for(size_t i = 0; i < old_cap; ++i)
+        {
+            if(old_ctrl[i] == ctrl_empty)
+                continue;
+
+            size_t idx = find_empty(hash(old_slots[i].first) >> 7);
+            set_ctrl(idx, old_ctrl[i]);
+            new(&_slots[idx]) slot(std::move(old_slots[i]));
+            old_slots[i].~slot();
+        }
+
+        ::operator delete(old_ctrl);
+        ::operator delete(old_slots);
     }
 
-    const_iterator begin() const { return _stack.cbegin(); }
-    const_iterator end() const   { return stack_t::const_iterator(&_stack[_num_frames]); }
+    void release()
+    {
+        for(size_t i = 0; i < capacity(); ++i)
+        {
+            if(_ctrl[i] != ctrl_empty)
+                _slots[i].~slot();
+        }
 
-private:
-    stack_t  _stack;
-    int      _num_frames;
+        ::operator delete(_ctrl);
+        ::operator delete(_slots);
+        _ctrl = nullptr;
+        _slots = nullptr;
+        _mask = 0;
+        _size = 0;
+        _growth_left = 0;
+    }
+
+    uint8_t* _ctrl;
+    slot* _slots;
+    size_t _mask;
+    size_t _size;
+    size_t _growth_left;
 };
 
-template<typename T>
-class memcheck
+// the range of the current thread stack, every valid frame lies within it
+inline void thread_stack_bounds(uintptr_t& low, uintptr_t& high)
 {
-private:
-    // an entry storing stack traces of construction & destruction of an object
-    struct obj_info
+    static thread_local uintptr_t stack_low = 0, stack_high = 0;
+
+    if(!stack_high)
     {
-        obj_info() :
-            create_trace(nullptr), destroy_trace(nullptr)
+        pthread_attr_t attr;
+        void* addr = nullptr;
+        size_t size = 0;
+
+        if(pthread_getattr_np(pthread_self(), &attr) == 0)
         {
+            pthread_attr_getstack(&attr, &addr, &size);
+            pthread_attr_destroy(&attr);
         }
 
-        call_stack* create_trace;
-        call_stack* destroy_trace;
-    };
+        stack_low = reinterpret_cast<uintptr_t>(addr);
+        stack_high = stack_low + size;
+    }
 
+    low = stack_low;
+    high = stack_high;
+}
+
+// modules (executable and shared libraries) loaded in the process. Code
+// addresses may be stored as a module index and offset, which do not depend
+// on the address space layout, so they can be symbolized on another machine
+// running the same build. Modules are never removed from the table, so their
+// indices remain valid.
+class module_table
+{
 public:
-    static memcheck<T>& get()
+    struct module
     {
-        // it has to be created on the heap so it is not destroyed at the
-        // end, as you may want to check whether everything was deleted
-        // if memcheck is the only leak, then you write good software
-        static memcheck<T>* inst = nullptr;
-
-        if(!inst)
-            inst = new memcheck<T>();
+        std::string path;
+        std::string build_id;           // hex string, empty if not available
+        uintptr_t base;                 // load bias, offset = address - base
+        uintptr_t start, end;           // range of the loaded segments
+        const uint8_t* eh_frame_hdr;
+    };
 
+    static module_table& get()
+    {
+        static module_table* inst = new module_table();
         return *inst;
     }
 
-    __attribute__((noinline))
-    bool created(const T* obj)
+    // finds the module containing an address, returns -1 if there is none
+    int find(const void* addr)
     {
-        assert(obj);
-
-        if(!obj)
-            return false;
+        uintptr_t pc = reinterpret_cast<uintptr_t>(addr);
+        std::lock_guard<std::mutex> lock(_lock);
+        int idx = lookup(pc);
 
-        obj_info& info = entries[obj];
+        if(idx < 0)
+        {
+            // maybe it comes from a library loaded with dlopen()
+            dl_iterate_phdr(add_module, this);
+            idx = lookup(pc);
+        }
 
-        // the object is either created for the first time or
-        // it has been created and destroyed already
-        assert((!info.create_trace && !info.destroy_trace)
-                || (info.create_trace && info.destroy_trace));
+        return idx;
+    }
 
-        info.create_trace = new call_stack();
-        info.destroy_trace = nullptr;   // mark as not yet destroyed
-        return true;
+    // returned reference is valid until the end of the process
+    const module& operator[](int idx)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _modules[idx];
     }
 
-    __attribute__((noinline))
-    bool destroyed(const T* obj)
+    size_t size()
     {
-        assert(obj);
+        std::lock_guard<std::mutex> lock(_lock);
+        return _modules.size();
+    }
 
-        if(!obj)
-            return false;
+    // changes whenever a module is loaded or unloaded (dlopen(), dlclose())
+    static uint64_t loader_generation()
+    {
+        uint64_t generation = 0;
 
-        obj_info& info = entries[obj];
+        dl_iterate_phdr([](struct dl_phdr_info* info, size_t size, void* data) {
+            if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+                *static_cast<uint64_t*>(data) = info->dlpi_adds + info->dlpi_subs;
 
-        // the object is either created for the first time or
-        // it has been created and destroyed already
-        assert(info.create_trace && !info.destroy_trace);
+            return 1;       // the counters are the same for all modules
+        }, &generation);
 
-        info.destroy_trace = new call_stack();
-        return true;
+        return generation;
     }
 
-    __attribute__((noinline))
-    bool exists(const T* obj) const
+private:
+    module_table()
     {
-        auto it = entries.find(obj);
-
-        if(it == entries.end())
-            return false;       // never created
+    }
 
-        const obj_info& info = it->second;
+    int lookup(uintptr_t pc) const
+    {
+        // newer modules first, they may reuse the address range of unloaded ones
+        for(int i = _modules.size() - 1; i >= 0; --i)
+        {
+            if(pc >= _modules[i].start && pc < _modules[i].end)
+                return i;
+        }
 
-        // check if it has been created but not yet destroyed
-        return (info.create_trace && !info.destroy_trace);
+        return -1;
     }
 
-    __attribute__((noinline))
-    void show_create(const T* obj) const
+    static int add_module(struct dl_phdr_info* info, size_t, void* data)
     {
-        assert(obj);
-        auto it = entries.find(obj);
-        call_stack* st = nullptr;
+        module_table* self = static_cast<module_table*>(data);
+        module mod;
+
+        mod.path = info->dlpi_name ? info->dlpi_name : "";
+        mod.base = info->dlpi_addr;
+        mod.start = UINTPTR_MAX;
+        mod.end = 0;
+        mod.eh_frame_hdr = nullptr;
 
-        if(it != entries.end() && (st = it->second.create_trace))
+        for(int i = 0; i < info->dlpi_phnum; ++i)
         {
-            std::cout << "construction stack trace for " << obj << std::endl;
-            std::cout << st->as_string();
-            return;
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+
+            if(phdr.p_type == PT_LOAD)
+            {
+                mod.start = std::min(mod.start, start);
+                mod.end = std::max(mod.end, start + phdr.p_memsz);
+            }
+            else if(phdr.p_type == PT_GNU_EH_FRAME)
+            {
+                mod.eh_frame_hdr = reinterpret_cast<const uint8_t*>(start);
+            }
+            else if(phdr.p_type == PT_NOTE && mod.build_id.empty())
+            {
+                mod.build_id = read_build_id(reinterpret_cast<const uint8_t*>(start), phdr.p_memsz);
+            }
         }
 
-        std::cerr << obj << "has not been created" << std::endl;
-    }
+        if(mod.start >= mod.end)
+            return 0;
 
-    __attribute__((noinline))
-    void show_destroy(const T* obj) const
-    {
-        assert(obj);
-        auto it = entries.find(obj);
-        call_stack* st = nullptr;
+        // the main executable has no name; it is resolved before comparing
+        // the modules, otherwise each rescan would add it again
+        if(mod.path.empty())
+        {
+            char path[4096];
+            ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
 
-        if(it != entries.end() && (st = it->second.destroy_trace))
+            if(len > 0)
+                mod.path.assign(path, len);
+        }
+
+        for(const module& other : self->_modules)
         {
-            std::cout << "destruction stack trace for " << obj << std::endl;
-            std::cout << st->as_string();
-            return;
+            if(other.base == mod.base && other.start == mod.start && other.path == mod.path)
+                return 0;       // already known
         }
 
-        std::cerr << obj << "has not been destroyed" << std::endl;
+        self->_modules.push_back(mod);
+        return 0;
     }
 
-    __attribute__((noinline))
-    void show_objs(bool show_stack = false) const
+    static std::string read_build_id(const uint8_t* notes, size_t size)
     {
-        std::cout << "existing objects:" << std::endl;
+        const uint8_t* end = notes + size;
 
-        for(const auto& info : entries)
+        while(notes + sizeof(ElfW(Nhdr)) <= end)
         {
-            const T* obj = info.first;
+            ElfW(Nhdr) nhdr;
+            memcpy(&nhdr, notes, sizeof(nhdr));
 
-            if(exists(obj))
+            const uint8_t* name = notes + sizeof(nhdr);
+            const uint8_t* desc = name + ((nhdr.n_namesz + 3) & ~3);
+            notes = desc + ((nhdr.n_descsz + 3) & ~3);
+
+            if(nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+                    && memcmp(name, "GNU", 4) == 0 && desc + nhdr.n_descsz <= end)
             {
-                std::cout << obj << std::endl;
+                static const char digits[] = "0123456789abcdef";
+                std::string build_id;
 
-                if(show_stack)
-                    show_create(obj);
+                for(size_t i = 0; i < nhdr.n_descsz; ++i)
+                {
+                    build_id += digits[desc[i] >> 4];
+                    build_id += digits[desc[i] & 0x0f];
+                }
+
+                return build_id;
             }
         }
+
+        return std::string();
     }
 
-    std::map<const T*, obj_info> entries;
+    std::mutex _lock;
+    std::deque<module> _modules;    // deque, so references to modules stay valid
 };
 
+#ifdef __x86_64__
+// stack unwinder interpreting the call frame information stored in
+// .eh_frame sections. Unlike the libgcc unwinder, it looks up the modules
+// only once and caches the rules decoded for each return address, so
+// capturing a stack trace from a known place costs a table lookup per frame.
+// Only the rules that are needed to find the caller (CFA, return address
+// and frame pointer) are decoded, anything more complex (e.g. DWARF
+// expressions used by signal trampolines) makes the unwinder give up.
+class eh_frame_unwinder
+{
+public:
+    static eh_frame_unwinder& get()
+    {
+        static eh_frame_unwinder* inst = new eh_frame_unwinder();
+        return *inst;
+    }
+
+    // stores up to max_depth return addresses in frames, starting with the
+    // caller of unwind(); returns the number of frames or -1 if any of
+    // the frames could not be unwound
+    __attribute__((noinline))
+    int unwind(void** frames, int max_depth)
+    {
+        uintptr_t pc, sp, bp;
+        asm volatile("lea 0(%%rip), %0\n\t"
+                     "mov %%rsp, %1\n\t"
+                     "mov %%rbp, %2"
+                     : "=r"(pc), "=r"(sp), "=r"(bp));
+
+        uintptr_t low, high;
+        thread_stack_bounds(low, high);
+
+        int num_frames = 0;
+        // pc points to an instruction in unwind(), for the callers it
+        // points after the call instruction, possibly outside the function
+        uintptr_t lookup_pc = pc;
+
+        while(num_frames < max_depth)
+        {
+            const cfa_rule rule = find_rule(lookup_pc);
+
+            if(rule.kind == rule_end || rule.kind == rule_unknown)
+                break;
+            else if(rule.kind == rule_unsupported)
+                return -1;
+
+            uintptr_t cfa = (rule.cfa_reg == reg_rsp ? sp : bp) + rule.cfa_offset;
+
+            if(cfa % sizeof(void*) || cfa <= sp || cfa > high)
+                return -1;
+
+            pc = *reinterpret_cast<const uintptr_t*>(cfa + rule.ra_offset);
+
+            if(rule.bp_saved)
+                bp = *reinterpret_cast<const uintptr_t*>(cfa + rule.bp_offset);
+
+            sp = cfa;
+
+            if(!pc)
+                break;
+
+            frames[num_frames++] = reinterpret_cast<void*>(pc);
+            lookup_pc = pc - 1;
+        }
+
+        return num_frames;
+    }
+
+    // number of distinct return addresses with cached rules
+    size_t cached_rules()
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(_rules_lock);
+        return _rules.size();
+    }
+
+private:
+    eh_frame_unwinder()
+        : _generation(module_table::loader_generation()), _epoch(0)
+    {
+    }
+
+    // DWARF register numbers
+    enum { reg_rbp = 6, reg_rsp = 7, reg_ra = 16 };
+
+    // size of the per-thread cache of rules
+    static const int recent_rules = 256;
+
+    enum rule_kind : uint8_t
+    {
+        rule_ok,
+        rule_end,           // outermost frame, or code without unwind information
+        rule_unknown,       // code outside of the loaded modules
+        rule_unsupported    // cannot be unwound with the simplified rules
+    };
+
+    // how to find the caller registers, valid at a particular address
+    struct cfa_rule
+    {
+        rule_kind kind;
+        uint8_t cfa_reg;        // CFA = cfa_reg + cfa_offset
+        bool bp_saved;          // otherwise the caller rbp is not changed
+        int32_t cfa_offset;
+        int32_t ra_offset;      // return address is stored at CFA + ra_offset
+        int32_t bp_offset;      // caller rbp is stored at CFA + bp_offset
+    };
+
+    cfa_rule find_rule(uintptr_t pc)
+    {
+        // the most recently used rules are kept per thread, so hot call
+        // sites do not need to touch the shared lock
+        static thread_local std::pair<uintptr_t, cfa_rule> recent[recent_rules];
+        static thread_local uint64_t recent_epoch = 0;
+        uint64_t epoch = _epoch.load(std::memory_order_acquire);
+        std::pair<uintptr_t, cfa_rule>& entry = recent[(pc ^ (pc >> 9)) % recent_rules];
+
+        // rules for unknown code are rechecked below
+        if(entry.first == pc && recent_epoch == epoch && entry.second.kind != rule_unknown)
+            return entry.second;
+
+        if(recent_epoch != epoch)
+        {
+            std::fill(recent, recent + recent_rules, std::make_pair(uintptr_t(0), cfa_rule()));
+            recent_epoch = epoch;
+        }
+
+        cfa_rule rule;
+        bool found = false;
+
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_rules_lock);
+            auto it = _rules.find(pc);
+
+            if(it != _rules.end())
+            {
+                rule = it->second;
+                found = true;
+            }
+        }
+
+        // a library might have been loaded there since the rule was cached,
+        // then the cached rules of unloaded libraries are dropped as well
+        if(found && rule.kind == rule_unknown)
+        {
+            uint64_t generation = module_table::loader_generation();
+
+            if(generation != _generation.load(std::memory_order_relaxed))
+            {
+                std::unique_lock<std::shared_timed_mutex> lock(_rules_lock);
+                _rules.clear();
+                _generation.store(generation, std::memory_order_relaxed);
+                _epoch.fetch_add(1, std::memory_order_release);
+                found = false;
+            }
+        }
+
+        if(!found)
+        {
+            // decode outside of the lock, another thread might do the same
+            rule = decode_rule(pc);
+            std::unique_lock<std::shared_timed_mutex> lock(_rules_lock);
+            _rules[pc] = rule;
+        }
+
+        entry = std::make_pair(pc, rule);
+        return rule;
+    }
+
+    cfa_rule decode_rule(uintptr_t pc)
+    {
+        cfa_rule rule = cfa_rule();
+        int mod = module_table::get().find(reinterpret_cast<const void*>(pc));
+        rule.kind = mod >= 0 ? rule_end : rule_unknown;
+
+        const uint8_t* hdr = mod >= 0 ? module_table::get()[mod].eh_frame_hdr : nullptr;
+        const uint8_t* fde = hdr ? find_fde(hdr, pc) : nullptr;
+
+        if(fde)
+            rule.kind = execute_cfi(fde, pc, rule);
+
+        return rule;
+    }
+
+    // pointer encodings (DW_EH_PE_*)
+    enum
+    {
+        pe_absptr = 0x00, pe_uleb128 = 0x01, pe_udata2 = 0x02, pe_udata4 = 0x03,
+        pe_udata8 = 0x04, pe_sleb128 = 0x09, pe_sdata2 = 0x0a, pe_sdata4 = 0x0b,
+        pe_sdata8 = 0x0c, pe_pcrel = 0x10, pe_datarel = 0x30, pe_indirect = 0x80,
+        pe_omit = 0xff
+    };
+
+    template<typename V>
+    static V read(const uint8_t*& p)
+    {
+        V value;
+        memcpy(&value, p, sizeof(V));
+        p += sizeof(V);
+        return value;
+    }
+
+    static uint64_t read_uleb(const uint8_t*& p)
+    {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+
+        do
+        {
+            byte = *p++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        return value;
+    }
+
+    static int64_t read_sleb(const uint8_t*& p)
+    {
+        int64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+
+        do
+        {
+            byte = *p++;
+            value |= int64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        if(shift < 64 && (byte & 0x40))
+            value |= -(int64_t(1) << shift);
+
+        return value;
+    }
+
+    static uintptr_t read_encoded(const uint8_t*& p, uint8_t encoding, uintptr_t datarel = 0)
+    {
+        if(encoding == pe_omit)
+            return 0;
+
+        const uint8_t* start = p;
+        uintptr_t value = 0;
+
+        switch(encoding & 0x0f)
+        {
+            case pe_absptr:  value = read<uintptr_t>(p); break;
+            case pe_uleb128: value = read_uleb(p); break;
+            case pe_udata2:  value = read<uint16_t>(p); break;
+            case pe_udata4:  value = read<uint32_t>(p); break;
+            case pe_udata8:  value = read<uint64_t>(p); break;
+            case pe_sleb128: value = read_sleb(p); break;
+            case pe_sdata2:  value = read<int16_t>(p); break;
+            case pe_sdata4:  value = read<int32_t>(p); break;
+            case pe_sdata8:  value = read<int64_t>(p); break;
+            default:         assert(false); break;
+        }
+
+        if(value == 0)
+            return 0;
+
+        switch(encoding & 0x70)
+        {
+            case pe_pcrel:   value += reinterpret_cast<uintptr_t>(start); break;
+            case pe_datarel: value += datarel; break;
+            default: break;
+        }
+
+        if(encoding & pe_indirect)
+            value = *reinterpret_cast<const uintptr_t*>(value);
+
+        return value;
+    }
+
+    // finds the frame description entry covering pc using the sorted
+    // lookup table stored in .eh_frame_hdr
+    static const uint8_t* find_fde(const uint8_t* hdr, uintptr_t pc)
+    {
+        const uint8_t* p = hdr;
+        const uintptr_t base = reinterpret_cast<uintptr_t>(hdr);
+
+        uint8_t version = *p++;
+        uint8_t eh_frame_ptr_enc = *p++;
+        uint8_t fde_count_enc = *p++;
+        uint8_t table_enc = *p++;
+
+        // the only table format emitted by linkers in practice
+        if(version != 1 || table_enc != (pe_datarel | pe_sdata4))
+            return nullptr;
+
+        read_encoded(p, eh_frame_ptr_enc, base);
+        size_t count = read_encoded(p, fde_count_enc, base);
+
+        struct entry
+        {
+            int32_t initial_loc;
+            int32_t fde;
+        };
+
+        const entry* table = reinterpret_cast<const entry*>(p);
+        const intptr_t rel_pc = pc - base;
+        size_t lo = 0, hi = count;
+
+        // find the last entry starting at or before pc
+        while(lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+
+            if(table[mid].initial_loc <= rel_pc)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if(lo == 0)
+            return nullptr;
+
+        return hdr + table[lo - 1].fde;
+    }
+
+    // register rules tracked while interpreting call frame instructions
+    struct cfi_state
+    {
+        uint8_t cfa_reg;
+        bool cfa_valid;
+        int64_t cfa_offset;
+
+        enum { undefined, same_value, offset, unsupported } ra, bp;
+        int64_t ra_offset, bp_offset;
+    };
+
+    struct cie_info
+    {
+        uint64_t code_align;
+        int64_t data_align;
+        uint8_t fde_encoding;
+        bool has_augmentation_data;
+        const uint8_t* instructions;
+        const uint8_t* end;
+    };
+
+    // parses a length field of a CIE or FDE, returns the end of the entry
+    static const uint8_t* read_length(const uint8_t*& p)
+    {
+        uint64_t length = read<uint32_t>(p);
+
+        if(length == 0xffffffff)
+            length = read<uint64_t>(p);
+
+        return p + length;
+    }
+
+    static bool parse_cie(const uint8_t* p, cie_info& cie)
+    {
+        cie.end = read_length(p);
+
+        if(read<uint32_t>(p) != 0)     // CIE id
+            return false;
+
+        uint8_t version = *p++;
+        const char* augmentation = reinterpret_cast<const char*>(p);
+        p += strlen(augmentation) + 1;
+
+        if(augmentation[0] == 'e' && augmentation[1] == 'h')
+            p += sizeof(uintptr_t);
+
+        cie.code_align = read_uleb(p);
+        cie.data_align = read_sleb(p);
+
+        if(version == 1)
+            ++p;
+        else
+            read_uleb(p);           // return address register
+
+        cie.fde_encoding = pe_absptr;
+        cie.has_augmentation_data = (augmentation[0] == 'z');
+
+        if(cie.has_augmentation_data)
+        {
+            uint64_t length = read_uleb(p);
+            const uint8_t* data = p;
+
+            for(const char* c = augmentation + 1; *c; ++c)
+            {
+                switch(*c)
+                {
+                    case 'R': cie.fde_encoding = *data++; break;
+                    case 'L': ++data; break;
+                    case 'P':
+                    {
+                        uint8_t encoding = *data++;
+                        read_encoded(data, encoding & ~pe_indirect);
+                        break;
+                    }
+                    case 'S': break;
+                    default: return false;
+                }
+            }
+
+            p += length;
+        }
+
+        cie.instructions = p;
+        return true;
+    }
+
+    // computes the unwinding rule valid at pc from the frame description entry
+    static rule_kind execute_cfi(const uint8_t* fde, uintptr_t pc, cfa_rule& rule)
+    {
+        const uint8_t* p = fde;
+        const uint8_t* fde_end = read_length(p);
+
+        // the CIE pointer is relative to its own position
+        const uint8_t* id_pos = p;
+        const uint8_t* cie_ptr = id_pos - read<uint32_t>(p);
+
+        cie_info cie;
+
+        if(!parse_cie(cie_ptr, cie))
+            return rule_unsupported;
+
+        uintptr_t loc = read_encoded(p, cie.fde_encoding);
+        uintptr_t range = read_encoded(p, cie.fde_encoding & 0x0f);
+
+        // no unwind information, e.g. hand written assembly
+        if(pc < loc || pc >= loc + range)
+            return rule_end;
+
+        if(cie.has_augmentation_data)
+            p += read_uleb(p);
+
+        cfi_state initial = cfi_state();
+        initial.ra = initial.bp = cfi_state::same_value;
+
+        if(!run_cfi(cie.instructions, cie.end, cie, initial, initial, UINTPTR_MAX, loc))
+            return rule_unsupported;
+
+        cfi_state state = initial;
+
+        if(!run_cfi(p, fde_end, cie, initial, state, pc, loc))
+            return rule_unsupported;
+
+        if(state.ra == cfi_state::undefined)
+            return rule_end;
+
+        if(!state.cfa_valid || state.ra != cfi_state::offset
+                || state.bp == cfi_state::unsupported
+                || (state.cfa_reg != reg_rsp && state.cfa_reg != reg_rbp))
+            return rule_unsupported;
+
+        rule.cfa_reg = state.cfa_reg;
+        rule.cfa_offset = state.cfa_offset;
+        rule.ra_offset = state.ra_offset;
+        rule.bp_saved = (state.bp == cfi_state::offset);
+        rule.bp_offset = state.bp_offset;
+        return rule_ok;
+    }
+
+    // interprets call frame instructions until the location exceeds pc
+    static bool run_cfi(const uint8_t* p, const uint8_t* end, const cie_info& cie,
+            const cfi_state& initial, cfi_state& state, uintptr_t pc, uintptr_t loc)
+    {
+        const int max_remembered = 8;
+        cfi_state remembered[max_remembered];
+        int num_remembered = 0;
+
+        // update a rule of one of the tracked registers
+        auto set_rule = [&](uint64_t reg, int kind, int64_t offset)
+        {
+            if(reg == reg_ra)
+            {
+                state.ra = static_cast<decltype(state.ra)>(kind);
+                state.ra_offset = offset;
+            }
+            else if(reg == reg_rbp)
+            {
+                state.bp = static_cast<decltype(state.bp)>(kind);
+                state.bp_offset = offset;
+            }
+        };
+
+        auto restore_rule = [&](uint64_t reg)
+        {
+            if(reg == reg_ra)
+                set_rule(reg, initial.ra, initial.ra_offset);
+            else if(reg == reg_rbp)
+                set_rule(reg, initial.bp, initial.bp_offset);
+        };
+
+        while(p < end)
+        {
+            uint8_t op = *p++;
+            uint64_t reg;
+            uintptr_t advance = 0;
+
+            switch(op & 0xc0)
+            {
+                case 0x40:      // DW_CFA_advance_loc
+                    advance = (op & 0x3f) * cie.code_align;
+                    break;
+
+                case 0x80:      // DW_CFA_offset
+                    set_rule(op & 0x3f, cfi_state::offset, read_uleb(p) * cie.data_align);
+                    continue;
+
+                case 0xc0:      // DW_CFA_restore
+                    restore_rule(op & 0x3f);
+                    continue;
+
+                default:
+                    switch(op)
+                    {
+                        case 0x00:  // DW_CFA_nop
+                            break;
+
+                        case 0x01:  // DW_CFA_set_loc
+                            if(read_encoded(p, cie.fde_encoding) > pc)
+                                return true;
+                            break;
+
+                        case 0x02: advance = read<uint8_t>(p) * cie.code_align; break;
+                        case 0x03: advance = read<uint16_t>(p) * cie.code_align; break;
+                        case 0x04: advance = read<uint32_t>(p) * cie.code_align; break;
+
+                        case 0x05:  // DW_CFA_offset_extended
+                            reg = read_uleb(p);
+                            set_rule(reg, cfi_state::offset, read_uleb(p) * cie.data_align);
+                            break;
+
+                        case 0x06:  // DW_CFA_restore_extended
+                            restore_rule(read_uleb(p));
+                            break;
+
+                        case 0x07:  // DW_CFA_undefined
+                            set_rule(read_uleb(p), cfi_state::undefined, 0);
+                            break;
+
+                        case 0x08:  // DW_CFA_same_value
+                            set_rule(read_uleb(p), cfi_state::same_value, 0);
+                            break;
+
+                        case 0x09:  // DW_CFA_register
+                            set_rule(read_uleb(p), cfi_state::unsupported, 0);
+                            read_uleb(p);
+                            break;
+
+                        case 0x0a:  // DW_CFA_remember_state
+                            if(num_remembered == max_remembered)
+                                return false;
+                            remembered[num_remembered++] = state;
+                            break;
+
+                        case 0x0b:  // DW_CFA_restore_state
+                            if(num_remembered == 0)
+                                return false;
+                            state = remembered[--num_remembered];
+                            break;
+
+                        case 0x0c:  // DW_CFA_def_cfa
+                            state.cfa_reg = read_uleb(p);
+                            state.cfa_offset = read_uleb(p);
+                            state.cfa_valid = true;
+                            break;
+
+                        case 0x0d:  // DW_CFA_def_cfa_register
+                            state.cfa_reg = read_uleb(p);
+                            break;
+
+                        case 0x0e:  // DW_CFA_def_cfa_offset
+                            state.cfa_offset = read_uleb(p);
+                            break;
+
+                        case 0x0f:  // DW_CFA_def_cfa_expression
+                            p += read_uleb(p);
+                            state.cfa_valid = false;
+                            break;
+
+                        case 0x10:  // DW_CFA_expression
+                        case 0x16:  // DW_CFA_val_expression
+                            set_rule(read_uleb(p), cfi_state::unsupported, 0);
+                            p += read_uleb(p);
+                            break;
+
+                        case 0x11:  // DW_CFA_offset_extended_sf
+                            reg = read_uleb(p);
+                            set_rule(reg, cfi_state::offset, read_sleb(p) * cie.data_align);
+                            break;
+
+                        case 0x12:  // DW_CFA_def_cfa_sf
+                            state.cfa_reg = read_uleb(p);
+                            state.cfa_offset = read_sleb(p) * cie.data_align;
+                            state.cfa_valid = true;
+                            break;
+
+                        case 0x13:  // DW_CFA_def_cfa_offset_sf
+                            state.cfa_offset = read_sleb(p) * cie.data_align;
+                            break;
+
+                        case 0x14:  // DW_CFA_val_offset
+                        case 0x15:  // DW_CFA_val_offset_sf
+                            set_rule(read_uleb(p), cfi_state::unsupported, 0);
+                            read_uleb(p);
+                            break;
+
+                        case 0x2e:  // DW_CFA_GNU_args_size
+                            read_uleb(p);
+                            break;
+
+                        case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+                            reg = read_uleb(p);
+                            set_rule(reg, cfi_state::offset, -int64_t(read_uleb(p)) * cie.data_align);
+                            break;
+
+                        default:
+                            return false;
+                    }
+            }
+
+            if(advance)
+            {
+                loc += advance;
+
+                // the following instructions describe code after pc
+                if(loc > pc)
+                    return true;
+            }
+        }
+
+        return true;
+    }
+
+    std::shared_timed_mutex _rules_lock;
+    flat_table<uint64_t, cfa_rule> _rules;
+
+    // loader generation the rules were decoded in, and the number of times
+    // they were dropped, so the per-thread caches are dropped too
+    std::atomic<uint64_t> _generation;
+    std::atomic<uint64_t> _epoch;
+};
+#endif /* __x86_64__ */
+
+// read-only view of an ELF file mapped into memory
+class elf_image
+{
+public:
+    struct section
+    {
+        section() : data(nullptr), size(0), addr(0) {}
+
+        const uint8_t* data;
+        size_t size;
+        uint64_t addr;          // virtual address, if the section is loaded
+    };
+
+    elf_image(const std::string& path)
+        : _data(nullptr), _size(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if(fd < 0)
+            return;
+
+        struct stat st;
+
+        if(fstat(fd, &st) == 0 && size_t(st.st_size) > sizeof(ElfW(Ehdr)))
+        {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if(data != MAP_FAILED)
+            {
+                _data = static_cast<const uint8_t*>(data);
+                _size = st.st_size;
+            }
+        }
+
+        close(fd);
+
+        if(_data && !valid())
+        {
+            munmap(const_cast<uint8_t*>(_data), _size);
+            _data = nullptr;
+            _size = 0;
+        }
+    }
+
+    elf_image(const elf_image&) = delete;
+    elf_image& operator=(const elf_image&) = delete;
+
+    ~elf_image()
+    {
+        if(_data)
+            munmap(const_cast<uint8_t*>(_data), _size);
+    }
+
+    bool is_open() const
+    {
+        return _data != nullptr;
+    }
+
+    // returns an empty section if there is none with the given name,
+    // or it is compressed
+    section find_section(const char* name) const
+    {
+        section sec;
+
+        if(!_data)
+            return sec;
+
+        const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(_data);
+        const ElfW(Shdr)* shdrs = reinterpret_cast<const ElfW(Shdr)*>(_data + ehdr->e_shoff);
+        const ElfW(Shdr)& strtab = shdrs[ehdr->e_shstrndx];
+
+        for(int i = 0; i < ehdr->e_shnum; ++i)
+        {
+            const ElfW(Shdr)& shdr = shdrs[i];
+            const char* sec_name = reinterpret_cast<const char*>(_data + strtab.sh_offset + shdr.sh_name);
+
+            if(strcmp(sec_name, name) != 0 || shdr.sh_type == SHT_NOBITS
+                    || (shdr.sh_flags & SHF_COMPRESSED)
+                    || shdr.sh_offset + shdr.sh_size > _size)
+                continue;
+
+            sec.data = _data + shdr.sh_offset;
+            sec.size = shdr.sh_size;
+            sec.addr = shdr.sh_addr;
+            break;
+        }
+
+        return sec;
+    }
+
+private:
+    bool valid() const
+    {
+        const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(_data);
+
+        return memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0
+            && ehdr->e_ident[EI_CLASS] == (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+            && ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) <= _size
+            && ehdr->e_shstrndx < ehdr->e_shnum;
+    }
+
+    const uint8_t* _data;
+    size_t _size;
+};
+
+// DWARF reading primitives
+namespace dwarf
+{
+    template<typename V>
+    inline V read(const uint8_t*& p)
+    {
+        V value;
+        memcpy(&value, p, sizeof(V));
+        p += sizeof(V);
+        return value;
+    }
+
+    inline uint64_t read_uleb(const uint8_t*& p)
+    {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+
+        do
+        {
+            byte = *p++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        return value;
+    }
+
+    inline int64_t read_sleb(const uint8_t*& p)
+    {
+        int64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+
+        do
+        {
+            byte = *p++;
+            value |= int64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        if(shift < 64 && (byte & 0x40))
+            value |= -(int64_t(1) << shift);
+
+        return value;
+    }
+}
+
+// source lines of a module, decoded from .debug_line once and kept as an
+// array sorted by address, so each lookup is a binary search
+class line_table
+{
+public:
+    line_table(const elf_image& elf)
+    {
+        elf_image::section debug_line = elf.find_section(".debug_line");
+        _line_str = elf.find_section(".debug_line_str");
+        _str = elf.find_section(".debug_str");
+
+        const uint8_t* p = debug_line.data;
+        const uint8_t* end = p + debug_line.size;
+
+        while(p && p < end)
+        {
+            if(!parse_unit(p, end, p - debug_line.data))
+                break;
+        }
+
+        // sequence ends go before rows starting at the same address
+        std::stable_sort(_rows.begin(), _rows.end(), [](const row& a, const row& b) {
+            return a.addr < b.addr || (a.addr == b.addr && a.line == 0 && b.line != 0);
+        });
+
+        _rows.shrink_to_fit();
+    }
+
+    bool empty() const
+    {
+        return _rows.empty();
+    }
+
+    // finds the source line for a virtual address of the module
+    bool lookup(uint64_t addr, const char*& file, int& line) const
+    {
+        auto it = std::upper_bound(_rows.begin(), _rows.end(), addr,
+                [](uint64_t a, const row& r) { return a < r.addr; });
+
+        if(it == _rows.begin() || (--it)->line == 0)
+            return false;
+
+        file = _files[it->file].c_str();
+        line = it->line;
+        return true;
+    }
+
+    // finds a file of the line number program at the given offset
+    // in .debug_line, as numbered by the program (e.g. DW_AT_call_file)
+    const char* file_name(uint64_t unit, uint64_t file) const
+    {
+        auto it = _units.find(unit);
+
+        if(it == _units.end() || file >= it->second.size())
+            return nullptr;
+
+        return _files[it->second[file]].c_str();
+    }
+
+private:
+    struct row
+    {
+        uint64_t addr;
+        uint32_t file;          // index in _files
+        uint32_t line;          // 0 marks the end of a sequence
+    };
+
+    // DWARF constants used by the line number programs
+    enum
+    {
+        form_block = 0x09, form_data1 = 0x0b, form_data2 = 0x05, form_data4 = 0x06,
+        form_data8 = 0x07, form_data16 = 0x1e, form_line_strp = 0x1f, form_string = 0x08,
+        form_strp = 0x0e, form_udata = 0x0f,
+        lnct_path = 0x1, lnct_directory_index = 0x2
+    };
+
+    const char* string_at(const elf_image::section& sec, uint64_t offset) const
+    {
+        return offset < sec.size ? reinterpret_cast<const char*>(sec.data + offset) : "";
+    }
+
+    // reads an attribute of a directory or file entry (DWARF 5)
+    bool read_form(const uint8_t*& p, uint64_t form, bool dwarf64,
+            const char*& str, uint64_t& value) const
+    {
+        switch(form)
+        {
+            case form_string:
+                str = reinterpret_cast<const char*>(p);
+                p += strlen(str) + 1;
+                break;
+
+            case form_line_strp:
+            case form_strp:
+            {
+                uint64_t offset = dwarf64 ? dwarf::read<uint64_t>(p) : dwarf::read<uint32_t>(p);
+                str = string_at(form == form_strp ? _str : _line_str, offset);
+                break;
+            }
+
+            case form_udata:  value = dwarf::read_uleb(p); break;
+            case form_data1:  value = dwarf::read<uint8_t>(p); break;
+            case form_data2:  value = dwarf::read<uint16_t>(p); break;
+            case form_data4:  value = dwarf::read<uint32_t>(p); break;
+            case form_data8:  value = dwarf::read<uint64_t>(p); break;
+            case form_data16: p += 16; break;
+            case form_block:  p += dwarf::read_uleb(p); break;
+            default:          return false;
+        }
+
+        return true;
+    }
+
+    // reads the directory or file name table of a DWARF 5 header
+    bool read_entries(const uint8_t*& p, bool dwarf64,
+            std::vector<std::pair<const char*, uint64_t>>& entries) const
+    {
+        uint8_t format_count = *p++;
+        std::vector<std::pair<uint64_t, uint64_t>> formats;
+
+        for(int i = 0; i < format_count; ++i)
+        {
+            uint64_t content = dwarf::read_uleb(p);
+            formats.push_back(std::make_pair(content, dwarf::read_uleb(p)));
+        }
+
+        uint64_t count = dwarf::read_uleb(p);
+
+        for(uint64_t i = 0; i < count; ++i)
+        {
+            const char* path = "";
+            uint64_t dir = 0;
+
+            for(const auto& fmt : formats)
+            {
+                const char* str = nullptr;
+                uint64_t value = 0;
+
+                if(!read_form(p, fmt.second, dwarf64, str, value))
+                    return false;
+
+                if(fmt.first == lnct_path && str)
+                    path = str;
+                else if(fmt.first == lnct_directory_index)
+                    dir = value;
+            }
+
+            entries.push_back(std::make_pair(path, dir));
+        }
+
+        return true;
+    }
+
+    uint32_t add_file(const char* name, const char* dir)
+    {
+        if(name[0] == '/' || !dir || !dir[0])
+            _files.push_back(name);
+        else
+            _files.push_back(std::string(dir) + "/" + name);
+
+        return _files.size() - 1;
+    }
+
+    // decodes a single line number program, p is moved to the next one
+    bool parse_unit(const uint8_t*& p, const uint8_t* end, uint64_t offset)
+    {
+        uint64_t length = dwarf::read<uint32_t>(p);
+        bool dwarf64 = (length == 0xffffffff);
+
+        if(dwarf64)
+            length = dwarf::read<uint64_t>(p);
+
+        const uint8_t* unit_end = p + length;
+
+        if(unit_end > end)
+            return false;
+
+        uint16_t version = dwarf::read<uint16_t>(p);
+
+        if(version < 2 || version > 5)
+        {
+            p = unit_end;
+            return true;
+        }
+
+        if(version >= 5)
+            p += 2;         // address and segment selector sizes
+
+        uint64_t header_length = dwarf64 ? dwarf::read<uint64_t>(p) : dwarf::read<uint32_t>(p);
+        const uint8_t* program = p + header_length;
+
+        uint8_t min_inst_length = *p++;
+
+        if(version >= 4)
+            ++p;            // maximum operations per instruction, VLIW only
+
+        bool default_is_stmt = *p++;
+        int8_t line_base = *p++;
+        uint8_t line_range = *p++;
+        uint8_t opcode_base = *p++;
+        const uint8_t* opcode_lengths = p;
+        p += opcode_base - 1;
+
+        // file numbers used by the program, mapped to _files indices
+        std::vector<uint32_t> files;
+
+        if(version >= 5)
+        {
+            std::vector<std::pair<const char*, uint64_t>> dirs, names;
+
+            if(!read_entries(p, dwarf64, dirs) || !read_entries(p, dwarf64, names))
+            {
+                p = unit_end;
+                return true;
+            }
+
+            // directories other than the first one may be relative to it
+            std::vector<std::string> dir_paths;
+
+            for(size_t i = 0; i < dirs.size(); ++i)
+            {
+                std::string dir = dirs[i].first;
+
+                if(i > 0 && dir[0] != '/' && !dir_paths.empty())
+                    dir = dir == "." ? dir_paths[0] : dir_paths[0] + "/" + dir;
+
+                dir_paths.push_back(dir);
+            }
+
+            for(const auto& name : names)
+                files.push_back(add_file(name.first, name.second < dir_paths.size() ? dir_paths[name.second].c_str() : nullptr));
+        }
+        else
+        {
+            std::vector<const char*> dirs(1, nullptr);
+
+            while(*p)
+            {
+                dirs.push_back(reinterpret_cast<const char*>(p));
+                p += strlen(reinterpret_cast<const char*>(p)) + 1;
+            }
+
+            ++p;
+            files.push_back(add_file("??", nullptr));     // numbered from 1
+
+            while(*p)
+            {
+                const char* name = reinterpret_cast<const char*>(p);
+                p += strlen(name) + 1;
+                uint64_t dir = dwarf::read_uleb(p);
+                dwarf::read_uleb(p);        // modification time
+                dwarf::read_uleb(p);        // file length
+                files.push_back(add_file(name, dir < dirs.size() ? dirs[dir] : nullptr));
+            }
+        }
+
+        if(files.empty() || line_range == 0)
+        {
+            p = unit_end;
+            return true;
+        }
+
+        _units[offset] = files;
+
+        // line number state machine
+        uint64_t addr = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+        bool is_stmt = default_is_stmt;
+
+        auto emit = [&](bool end_sequence)
+        {
+            row r;
+            r.addr = addr;
+            r.file = files[file < files.size() ? file : 0];
+            r.line = end_sequence ? 0 : (line > 0 ? line : 1);
+            _rows.push_back(r);
+        };
+
+        p = program;
+
+        while(p < unit_end)
+        {
+            uint8_t op = *p++;
+
+            if(op >= opcode_base)
+            {
+                // special opcode: advance address and line, then emit a row
+                uint8_t adjusted = op - opcode_base;
+                addr += (adjusted / line_range) * min_inst_length;
+                line += line_base + adjusted % line_range;
+                emit(false);
+                continue;
+            }
+
+            switch(op)
+            {
+                case 0:     // extended opcode
+                {
+                    uint64_t len = dwarf::read_uleb(p);
+                    const uint8_t* next = p + len;
+
+                    if(len == 0)
+                        break;
+
+                    switch(*p++)
+                    {
+                        case 1:     // DW_LNE_end_sequence
+                            emit(true);
+                            addr = 0;
+                            file = 1;
+                            line = 1;
+                            is_stmt = default_is_stmt;
+                            break;
+
+                        case 2:     // DW_LNE_set_address
+                            addr = len == 9 ? dwarf::read<uint64_t>(p) : dwarf::read<uint32_t>(p);
+                            break;
+
+                        default:    // DW_LNE_define_file, DW_LNE_set_discriminator
+                            break;
+                    }
+
+                    p = next;
+                    break;
+                }
+
+                case 1:  emit(false); break;                                        // DW_LNS_copy
+                case 2:  addr += dwarf::read_uleb(p) * min_inst_length; break;      // DW_LNS_advance_pc
+                case 3:  line += dwarf::read_sleb(p); break;                        // DW_LNS_advance_line
+                case 4:  file = dwarf::read_uleb(p); break;                         // DW_LNS_set_file
+                case 6:  is_stmt = !is_stmt; break;                                 // DW_LNS_negate_stmt
+                case 8:  addr += ((255 - opcode_base) / line_range) * min_inst_length; break; // DW_LNS_const_add_pc
+                case 9:  addr += dwarf::read<uint16_t>(p); break;                   // DW_LNS_fixed_advance_pc
+
+                default:
+                    // skip the operands of opcodes that do not affect the rows
+                    for(int i = 0; i < opcode_lengths[op - 1]; ++i)
+                        dwarf::read_uleb(p);
+                    break;
+            }
+        }
+
+        (void) is_stmt;
+        p = unit_end;
+        return true;
+    }
+
+    std::vector<row> _rows;
+    std::vector<std::string> _files;
+    std::map<uint64_t, std::vector<uint32_t>> _units;    // file numbers of each program
+    elf_image::section _line_str;
+    elf_image::section _str;
+};
+
+// functions inlined into the code of a module, decoded from .debug_info
+// once: the address ranges of the inlined calls are split into an array
+// of non-overlapping segments sorted by address, each one pointing to the
+// innermost call covering it, so each lookup is a binary search
+class inline_table
+{
+public:
+    // an inlined function and the place it was called from
+    struct call
+    {
+        const char* name;       // linkage name if known, so it may be mangled
+        const char* file;
+        int line;
+    };
+
+    // the image and the line table have to outlive the inline table
+    inline_table(const elf_image& elf, const line_table& lines)
+        : _info(nullptr)
+    {
+        elf_image::section info = elf.find_section(".debug_info");
+        _abbrev = elf.find_section(".debug_abbrev");
+        _str = elf.find_section(".debug_str");
+        _line_str = elf.find_section(".debug_line_str");
+        _str_offsets = elf.find_section(".debug_str_offsets");
+        _addr = elf.find_section(".debug_addr");
+        _ranges = elf.find_section(".debug_ranges");
+        _rnglists = elf.find_section(".debug_rnglists");
+
+        if(!info.data || !_abbrev.data)
+            return;
+
+        _info = info.data;
+        const uint8_t* p = info.data;
+        const uint8_t* end = p + info.size;
+
+        while(p < end)
+        {
+            if(!parse_unit(p, end, lines))
+                break;
+        }
+
+        resolve_names();
+        build_segments();
+
+        _functions.clear();
+        _abbrevs.clear();
+        _parsed.clear();
+        _parsed.shrink_to_fit();
+        _calls.shrink_to_fit();
+    }
+
+    bool empty() const
+    {
+        return _calls.empty();
+    }
+
+    // finds the calls inlined at a virtual address of the module,
+    // the innermost one first
+    void lookup(uint64_t addr, std::vector<call>& calls) const
+    {
+        auto it = std::upper_bound(_segments.begin(), _segments.end(), addr,
+                [](uint64_t a, const segment& seg) { return a < seg.addr; });
+
+        if(it == _segments.begin())
+            return;
+
+        for(int idx = (--it)->call; idx >= 0; idx = _calls[idx].parent)
+            calls.push_back(_calls[idx].info);
+    }
+
+private:
+    struct inlined
+    {
+        call info;
+        int parent;             // index of the call this one is inlined into, or -1
+        uint64_t origin;        // .debug_info offset of the function entry
+    };
+
+    struct range
+    {
+        uint64_t low, high;
+        int call;
+    };
+
+    struct segment
+    {
+        uint64_t addr;
+        int call;               // innermost call covering the segment, or -1
+    };
+
+    // names of the function entries, and the entries they refer to
+    struct function
+    {
+        const char* name;
+        const char* linkage_name;
+        uint64_t origin;
+    };
+
+    struct attr_spec
+    {
+        uint64_t name;
+        uint64_t form;
+        int64_t implicit;       // value of DW_FORM_implicit_const
+    };
+
+    struct abbrev
+    {
+        abbrev() : tag(0), children(false) {}
+
+        uint64_t tag;
+        bool children;
+        std::vector<attr_spec> attrs;
+    };
+
+    // state of the unit being decoded
+    struct unit
+    {
+        const uint8_t* start;
+        uint16_t version;
+        uint8_t addr_size;
+        bool dwarf64;
+        uint64_t base;              // base address for range lists
+        uint64_t stmt_list;         // line number program
+        uint64_t str_offsets_base;
+        uint64_t addr_base;
+        uint64_t rnglists_base;
+    };
+
+    // DWARF constants used by the debugging information entries
+    enum
+    {
+        tag_compile_unit = 0x11, tag_inlined_subroutine = 0x1d, tag_subprogram = 0x2e,
+        tag_partial_unit = 0x3c, tag_skeleton_unit = 0x4a,
+
+        at_name = 0x03, at_stmt_list = 0x10, at_low_pc = 0x11, at_high_pc = 0x12,
+        at_abstract_origin = 0x31, at_specification = 0x47, at_ranges = 0x55,
+        at_call_file = 0x58, at_call_line = 0x59, at_linkage_name = 0x6e,
+        at_str_offsets_base = 0x72, at_addr_base = 0x73, at_rnglists_base = 0x74,
+        at_mips_linkage_name = 0x2007,
+
+        form_addr = 0x01, form_block2 = 0x03, form_block4 = 0x04, form_data2 = 0x05,
+        form_data4 = 0x06, form_data8 = 0x07, form_string = 0x08, form_block = 0x09,
+        form_block1 = 0x0a, form_data1 = 0x0b, form_flag = 0x0c, form_sdata = 0x0d,
+        form_strp = 0x0e, form_udata = 0x0f, form_ref_addr = 0x10, form_ref1 = 0x11,
+        form_ref2 = 0x12, form_ref4 = 0x13, form_ref8 = 0x14, form_ref_udata = 0x15,
+        form_indirect = 0x16, form_sec_offset = 0x17, form_exprloc = 0x18,
+        form_flag_present = 0x19, form_strx = 0x1a, form_addrx = 0x1b, form_ref_sup4 = 0x1c,
+        form_strp_sup = 0x1d, form_data16 = 0x1e, form_line_strp = 0x1f, form_ref_sig8 = 0x20,
+        form_implicit_const = 0x21, form_loclistx = 0x22, form_rnglistx = 0x23,
+        form_ref_sup8 = 0x24, form_strx1 = 0x25, form_strx2 = 0x26, form_strx3 = 0x27,
+        form_strx4 = 0x28, form_addrx1 = 0x29, form_addrx2 = 0x2a, form_addrx3 = 0x2b,
+        form_addrx4 = 0x2c, form_gnu_addr_index = 0x1f01, form_gnu_str_index = 0x1f02,
+        form_gnu_ref_alt = 0x1f20, form_gnu_strp_alt = 0x1f21
+    };
+
+    static bool is_address(uint64_t form)
+    {
+        return form == form_addr || form == form_addrx || form == form_gnu_addr_index
+            || (form >= form_addrx1 && form <= form_addrx4);
+    }
+
+    static uint64_t read_offset(const uint8_t*& p, bool dwarf64)
+    {
+        return dwarf64 ? dwarf::read<uint64_t>(p) : dwarf::read<uint32_t>(p);
+    }
+
+    static uint64_t read_address(const uint8_t*& p, uint8_t size)
+    {
+        return size == 8 ? dwarf::read<uint64_t>(p) : dwarf::read<uint32_t>(p);
+    }
+
+    static uint64_t read_unsigned(const uint8_t*& p, int size)
+    {
+        uint64_t value = 0;
+        memcpy(&value, p, size);    // little endian
+        p += size;
+        return value;
+    }
+
+    static const char* string_at(const elf_image::section& sec, uint64_t offset)
+    {
+        return offset < sec.size ? reinterpret_cast<const char*>(sec.data + offset) : nullptr;
+    }
+
+    const char* indexed_string(const unit& u, uint64_t index) const
+    {
+        uint64_t pos = u.str_offsets_base + index * (u.dwarf64 ? 8 : 4);
+
+        if(pos + (u.dwarf64 ? 8 : 4) > _str_offsets.size)
+            return nullptr;
+
+        const uint8_t* p = _str_offsets.data + pos;
+        return string_at(_str, read_offset(p, u.dwarf64));
+    }
+
+    uint64_t indexed_address(const unit& u, uint64_t index) const
+    {
+        uint64_t pos = u.addr_base + index * u.addr_size;
+
+        if(pos + u.addr_size > _addr.size)
+            return 0;
+
+        const uint8_t* p = _addr.data + pos;
+        return read_address(p, u.addr_size);
+    }
+
+    // reads an attribute value: strings are returned in str, references as
+    // .debug_info offsets, address indices are resolved
+    bool read_form(const uint8_t*& p, uint64_t form, int64_t implicit, const unit& u,
+            uint64_t& value, const char*& str) const
+    {
+        switch(form)
+        {
+            case form_addr:         value = read_address(p, u.addr_size); break;
+            case form_data1:
+            case form_flag:         value = read_unsigned(p, 1); break;
+            case form_data2:        value = read_unsigned(p, 2); break;
+            case form_data4:        value = read_unsigned(p, 4); break;
+            case form_data8:
+            case form_ref_sig8:     value = read_unsigned(p, 8); break;
+            case form_data16:       p += 16; break;
+            case form_sdata:        value = dwarf::read_sleb(p); break;
+            case form_udata:
+            case form_loclistx:
+            case form_rnglistx:     value = dwarf::read_uleb(p); break;
+            case form_implicit_const: value = implicit; break;
+            case form_flag_present: value = 1; break;
+
+            case form_block1:       p += read_unsigned(p, 1); break;
+            case form_block2:       p += read_unsigned(p, 2); break;
+            case form_block4:       p += read_unsigned(p, 4); break;
+            case form_block:
+            case form_exprloc:      p += dwarf::read_uleb(p); break;
+
+            case form_string:
+                str = reinterpret_cast<const char*>(p);
+                p += strlen(str) + 1;
+                break;
+
+            case form_strp:         str = string_at(_str, read_offset(p, u.dwarf64)); break;
+            case form_line_strp:    str = string_at(_line_str, read_offset(p, u.dwarf64)); break;
+            case form_strx:
+            case form_gnu_str_index: str = indexed_string(u, dwarf::read_uleb(p)); break;
+            case form_strx1:        str = indexed_string(u, read_unsigned(p, 1)); break;
+            case form_strx2:        str = indexed_string(u, read_unsigned(p, 2)); break;
+            case form_strx3:        str = indexed_string(u, read_unsigned(p, 3)); break;
+            case form_strx4:        str = indexed_string(u, read_unsigned(p, 4)); break;
+
+            case form_addrx:
+            case form_gnu_addr_index: value = indexed_address(u, dwarf::read_uleb(p)); break;
+            case form_addrx1:       value = indexed_address(u, read_unsigned(p, 1)); break;
+            case form_addrx2:       value = indexed_address(u, read_unsigned(p, 2)); break;
+            case form_addrx3:       value = indexed_address(u, read_unsigned(p, 3)); break;
+            case form_addrx4:       value = indexed_address(u, read_unsigned(p, 4)); break;
+
+            // references within the unit are turned into section offsets
+            case form_ref1:         value = u.start - _info + read_unsigned(p, 1); break;
+            case form_ref2:         value = u.start - _info + read_unsigned(p, 2); break;
+            case form_ref4:         value = u.start - _info + read_unsigned(p, 4); break;
+            case form_ref8:         value = u.start - _info + read_unsigned(p, 8); break;
+            case form_ref_udata:    value = u.start - _info + dwarf::read_uleb(p); break;
+
+            case form_ref_addr:
+                value = u.version <= 2 ? read_address(p, u.addr_size) : read_offset(p, u.dwarf64);
+                break;
+
+            // references to supplementary files are not followed
+            case form_sec_offset:
+            case form_strp_sup:
+            case form_gnu_ref_alt:
+            case form_gnu_strp_alt: value = read_offset(p, u.dwarf64); break;
+            case form_ref_sup4:     value = read_unsigned(p, 4); break;
+            case form_ref_sup8:     value = read_unsigned(p, 8); break;
+
+            case form_indirect:
+                return read_form(p, dwarf::read_uleb(p), implicit, u, value, str);
+
+            default:
+                return false;
+        }
+
+        return true;
+    }
+
+    // reads the abbreviation table at the given offset in .debug_abbrev,
+    // indexed by the abbreviation code
+    const std::vector<abbrev>* abbrevs(uint64_t offset)
+    {
+        auto it = _abbrevs.find(offset);
+
+        if(it != _abbrevs.end())
+            return &it->second;
+
+        if(offset >= _abbrev.size)
+            return nullptr;
+
+        std::vector<abbrev>& table = _abbrevs[offset];
+        const uint8_t* p = _abbrev.data + offset;
+        const uint8_t* end = _abbrev.data + _abbrev.size;
+
+        while(p < end)
+        {
+            uint64_t code = dwarf::read_uleb(p);
+
+            if(code == 0)
+                break;
+
+            // codes are assigned sequentially by compilers
+            if(code > 0xffff)
+                return nullptr;
+
+            if(code >= table.size())
+                table.resize(code + 1);
+
+            abbrev& ab = table[code];
+            ab.tag = dwarf::read_uleb(p);
+            ab.children = *p++;
+
+            while(p < end)
+            {
+                attr_spec spec;
+                spec.name = dwarf::read_uleb(p);
+                spec.form = dwarf::read_uleb(p);
+                spec.implicit = spec.form == form_implicit_const ? dwarf::read_sleb(p) : 0;
+
+                if(spec.name == 0 && spec.form == 0)
+                    break;
+
+                ab.attrs.push_back(spec);
+            }
+        }
+
+        return &table;
+    }
+
+    // appends the address ranges of an entry with DW_AT_ranges
+    void read_ranges(const unit& u, uint64_t value, bool indexed, int call)
+    {
+        if(u.version < 5)
+        {
+            if(value >= _ranges.size)
+                return;
+
+            const uint8_t* p = _ranges.data + value;
+            const uint8_t* end = _ranges.data + _ranges.size;
+            uint64_t base = u.base;
+            uint64_t max = u.addr_size == 8 ? ~uint64_t(0) : 0xffffffff;
+
+            while(p + 2 * u.addr_size <= end)
+            {
+                uint64_t begin = read_address(p, u.addr_size);
+                uint64_t finish = read_address(p, u.addr_size);
+
+                if(begin == 0 && finish == 0)
+                    break;
+
+                if(begin == max)
+                    base = finish;
+                else
+                    add_range(base + begin, base + finish, call);
+            }
+
+            return;
+        }
+
+        if(indexed)
+        {
+            uint64_t pos = u.rnglists_base + value * (u.dwarf64 ? 8 : 4);
+
+            if(pos + (u.dwarf64 ? 8 : 4) > _rnglists.size)
+                return;
+
+            const uint8_t* p = _rnglists.data + pos;
+            value = u.rnglists_base + read_offset(p, u.dwarf64);
+        }
+
+        if(value >= _rnglists.size)
+            return;
+
+        const uint8_t* p = _rnglists.data + value;
+        const uint8_t* end = _rnglists.data + _rnglists.size;
+        uint64_t base = u.base;
+
+        while(p < end)
+        {
+            uint64_t begin, length;
+
+            switch(*p++)
+            {
+                case 0:     // DW_RLE_end_of_list
+                    return;
+
+                case 1:     // DW_RLE_base_addressx
+                    base = indexed_address(u, dwarf::read_uleb(p));
+                    break;
+
+                case 2:     // DW_RLE_startx_endx
+                    begin = indexed_address(u, dwarf::read_uleb(p));
+                    add_range(begin, indexed_address(u, dwarf::read_uleb(p)), call);
+                    break;
+
+                case 3:     // DW_RLE_startx_length
+                    begin = indexed_address(u, dwarf::read_uleb(p));
+                    add_range(begin, begin + dwarf::read_uleb(p), call);
+                    break;
+
+                case 4:     // DW_RLE_offset_pair
+                    begin = dwarf::read_uleb(p);
+                    add_range(base + begin, base + dwarf::read_uleb(p), call);
+                    break;
+
+                case 5:     // DW_RLE_base_address
+                    base = read_address(p, u.addr_size);
+                    break;
+
+                case 6:     // DW_RLE_start_end
+                    begin = read_address(p, u.addr_size);
+                    add_range(begin, read_address(p, u.addr_size), call);
+                    break;
+
+                case 7:     // DW_RLE_start_length
+                    begin = read_address(p, u.addr_size);
+                    length = dwarf::read_uleb(p);
+                    add_range(begin, begin + length, call);
+                    break;
+
+                default:
+                    return;
+            }
+        }
+    }
+
+    void add_range(uint64_t low, uint64_t high, int call)
+    {
+        if(low >= high)
+            return;
+
+        range r;
+        r.low = low;
+        r.high = high;
+        r.call = call;
+        _parsed.push_back(r);
+    }
+
+    // decodes the entries of a single unit, p is moved to the next one
+    bool parse_unit(const uint8_t*& p, const uint8_t* end, const line_table& lines)
+    {
+        unit u;
+        u.start = p;
+        uint64_t length = dwarf::read<uint32_t>(p);
+        u.dwarf64 = (length == 0xffffffff);
+
+        if(u.dwarf64)
+            length = dwarf::read<uint64_t>(p);
+
+        const uint8_t* unit_end = p + length;
+
+        if(unit_end > end)
+            return false;
+
+        u.version = dwarf::read<uint16_t>(p);
+        uint64_t abbrev_offset;
+
+        if(u.version < 2 || u.version > 5)
+        {
+            p = unit_end;
+            return true;
+        }
+
+        if(u.version >= 5)
+        {
+            uint8_t type = *p++;
+            u.addr_size = *p++;
+            abbrev_offset = read_offset(p, u.dwarf64);
+
+            // only compile and partial units describe code
+            if(type != 0x01 && type != 0x03)
+            {
+                p = unit_end;
+                return true;
+            }
+        }
+        else
+        {
+            abbrev_offset = read_offset(p, u.dwarf64);
+            u.addr_size = *p++;
+        }
+
+        const std::vector<abbrev>* table = abbrevs(abbrev_offset);
+
+        if(!table || (u.addr_size != 4 && u.addr_size != 8))
+        {
+            p = unit_end;
+            return true;
+        }
+
+        u.base = 0;
+        u.stmt_list = ~uint64_t(0);
+        u.str_offsets_base = 8;             // defaults for DWARF 5 headers
+        u.addr_base = 8;
+        u.rnglists_base = 12;
+
+        // inlined calls enclosing the current entry
+        std::vector<int> parents(1, -1);
+
+        while(p < unit_end)
+        {
+            uint64_t offset = p - _info;
+            uint64_t code = dwarf::read_uleb(p);
+
+            if(code == 0)
+            {
+                if(parents.size() > 1)
+                    parents.pop_back();
+
+                continue;
+            }
+
+            if(code >= table->size() || (*table)[code].tag == 0)
+                break;
+
+            const abbrev& ab = (*table)[code];
+            const char* name = nullptr;
+            const char* linkage_name = nullptr;
+            uint64_t origin = 0, low = 0, high = 0, ranges = 0, call_file = 0, call_line = 0;
+            bool has_low = false, has_high = false, high_offset = false;
+            bool has_ranges = false, ranges_indexed = false;
+            bool ok = true;
+            const uint8_t* attrs = p;
+
+            for(const attr_spec& spec : ab.attrs)
+            {
+                uint64_t value = 0;
+                const char* str = nullptr;
+
+                if(!read_form(p, spec.form, spec.implicit, u, value, str))
+                {
+                    ok = false;
+                    break;
+                }
+
+                switch(spec.name)
+                {
+                    case at_name:               name = str; break;
+                    case at_linkage_name:
+                    case at_mips_linkage_name:  linkage_name = str; break;
+                    case at_abstract_origin:
+                    case at_specification:      origin = value; break;
+                    case at_low_pc:             low = value; has_low = true; break;
+                    case at_call_file:          call_file = value; break;
+                    case at_call_line:          call_line = value; break;
+                    case at_stmt_list:          u.stmt_list = value; break;
+                    case at_str_offsets_base:   u.str_offsets_base = value; break;
+                    case at_addr_base:          u.addr_base = value; break;
+                    case at_rnglists_base:      u.rnglists_base = value; break;
+
+                    case at_high_pc:
+                        high = value;
+                        has_high = true;
+                        high_offset = !is_address(spec.form);
+                        break;
+
+                    case at_ranges:
+                        ranges = value;
+                        has_ranges = true;
+                        ranges_indexed = spec.form == form_rnglistx;
+                        break;
+                }
+            }
+
+            if(!ok)
+                break;
+
+            int call = -1;
+
+            if(ab.tag == tag_compile_unit || ab.tag == tag_partial_unit || ab.tag == tag_skeleton_unit)
+            {
+                // DW_AT_low_pc may be an index read before DW_AT_addr_base,
+                // so the attributes are read again with the bases of the unit
+                const uint8_t* q = attrs;
+
+                for(const attr_spec& spec : ab.attrs)
+                {
+                    uint64_t value = 0;
+                    const char* str = nullptr;
+                    read_form(q, spec.form, spec.implicit, u, value, str);
+
+                    if(spec.name == at_low_pc)
+                        u.base = value;
+                }
+            }
+            else if(ab.tag == tag_subprogram)
+            {
+                if(name || linkage_name || origin)
+                {
+                    function& func = _functions[offset];
+                    func.name = name;
+                    func.linkage_name = linkage_name;
+                    func.origin = origin;
+                }
+            }
+            else if(ab.tag == tag_inlined_subroutine && (has_ranges || (has_low && has_high)))
+            {
+                call = _calls.size();
+                size_t num_ranges = _parsed.size();
+
+                if(has_ranges)
+                    read_ranges(u, ranges, ranges_indexed, call);
+                else
+                    add_range(low, high_offset ? low + high : high, call);
+
+                if(_parsed.size() > num_ranges)
+                {
+                    const char* file = lines.file_name(u.stmt_list, call_file);
+
+                    inlined in;
+                    in.info.name = nullptr;
+                    in.info.file = file ? file : "??";
+                    in.info.line = call_line;
+                    in.parent = parents.back();
+                    in.origin = origin;
+                    _calls.push_back(in);
+                }
+                else
+                {
+                    call = -1;
+                }
+            }
+
+            if(ab.children)
+                parents.push_back(call >= 0 ? call : parents.back());
+        }
+
+        p = unit_end;
+        return true;
+    }
+
+    // names the inlined functions, preferring linkage names, which are
+    // often found at the declaration the abstract instance refers to
+    void resolve_names()
+    {
+        for(inlined& in : _calls)
+        {
+            const char* name = nullptr;
+            uint64_t origin = in.origin;
+
+            for(int i = 0; i < 8 && origin; ++i)
+            {
+                auto it = _functions.find(origin);
+
+                if(it == _functions.end())
+                    break;
+
+                if(it->second.linkage_name)
+                {
+                    name = it->second.linkage_name;
+                    break;
+                }
+
+                if(!name)
+                    name = it->second.name;
+
+                origin = it->second.origin;
+            }
+
+            in.info.name = name ? name : "??";
+        }
+    }
+
+    // splits the ranges of the inlined calls into non-overlapping segments;
+    // ranges of nested calls are nested, so an outer range is opened first
+    // and the innermost open range covers the segment
+    void build_segments()
+    {
+        std::sort(_parsed.begin(), _parsed.end(), [](const range& a, const range& b) {
+            if(a.low != b.low)
+                return a.low < b.low;
+
+            if(a.high != b.high)
+                return a.high > b.high;
+
+            return a.call < b.call;
+        });
+
+        std::vector<const range*> open;
+        uint64_t cursor = 0;
+
+        auto emit = [&](uint64_t to)
+        {
+            if(to <= cursor)
+                return;
+
+            int call = open.empty() ? -1 : open.back()->call;
+
+            if(_segments.empty() || _segments.back().call != call)
+                _segments.push_back(segment{cursor, call});
+
+            cursor = to;
+        };
+
+        for(const range& r : _parsed)
+        {
+            while(!open.empty() && open.back()->high <= r.low)
+            {
+                emit(open.back()->high);
+                open.pop_back();
+            }
+
+            emit(r.low);
+            open.push_back(&r);
+        }
+
+        while(!open.empty())
+        {
+            emit(open.back()->high);
+            open.pop_back();
+        }
+
+        if(!_segments.empty())
+            _segments.push_back(segment{cursor, -1});
+
+        _segments.shrink_to_fit();
+    }
+
+    const uint8_t* _info;
+    elf_image::section _abbrev;
+    elf_image::section _str;
+    elf_image::section _line_str;
+    elf_image::section _str_offsets;
+    elf_image::section _addr;
+    elf_image::section _ranges;
+    elf_image::section _rnglists;
+
+    std::vector<inlined> _calls;
+    std::vector<segment> _segments;
+
+    // used only while decoding
+    std::vector<range> _parsed;
+    std::unordered_map<uint64_t, function> _functions;
+    std::map<uint64_t, std::vector<abbrev>> _abbrevs;
+};
+
+// function symbols of a module, read from .symtab (or .dynsym if the
+// module is stripped) into an array sorted by address. Unlike dladdr(),
+// it finds static and hidden functions, and works without -rdynamic.
+class symbol_table
+{
+public:
+    // the image has to outlive the table, symbol names point to it
+    symbol_table(const elf_image& elf)
+    {
+        if(!load(elf, ".symtab", ".strtab"))
+            load(elf, ".dynsym", ".dynstr");
+
+        std::sort(_symbols.begin(), _symbols.end(), [](const symbol& a, const symbol& b) {
+            return a.addr < b.addr;
+        });
+
+        _symbols.shrink_to_fit();
+    }
+
+    bool empty() const
+    {
+        return _symbols.empty();
+    }
+
+    // finds the function containing a virtual address of the module
+    bool lookup(uint64_t addr, const char*& name, uint64_t& start) const
+    {
+        auto it = std::upper_bound(_symbols.begin(), _symbols.end(), addr,
+                [](uint64_t a, const symbol& sym) { return a < sym.addr; });
+
+        if(it == _symbols.begin() || addr >= (--it)->addr + it->size)
+            return false;
+
+        name = it->name;
+        start = it->addr;
+        return true;
+    }
+
+private:
+    struct symbol
+    {
+        uint64_t addr;
+        uint64_t size;
+        const char* name;
+    };
+
+    bool load(const elf_image& elf, const char* symtab_name, const char* strtab_name)
+    {
+        elf_image::section symtab = elf.find_section(symtab_name);
+        elf_image::section strtab = elf.find_section(strtab_name);
+
+        if(!symtab.data || !strtab.data)
+            return false;
+
+        const ElfW(Sym)* syms = reinterpret_cast<const ElfW(Sym)*>(symtab.data);
+        size_t count = symtab.size / sizeof(ElfW(Sym));
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            const ElfW(Sym)& sym = syms[i];
+            int type = ELF64_ST_TYPE(sym.st_info);
+
+            if((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_shndx == SHN_UNDEF
+                    || sym.st_size == 0 || sym.st_name >= strtab.size)
+                continue;
+
+            symbol entry;
+            entry.addr = sym.st_value;
+            entry.size = sym.st_size;
+            entry.name = reinterpret_cast<const char*>(strtab.data + sym.st_name);
+            _symbols.push_back(entry);
+        }
+
+        return !_symbols.empty();
+    }
+
+    std::vector<symbol> _symbols;
+};
+
+// debug information (function symbols and source lines) of the loaded
+// modules, read from the module files once, on first use
+class debug_info
+{
+public:
+    static debug_info& get()
+    {
+        static debug_info* inst = new debug_info();
+        return *inst;
+    }
+
+    // finds the function containing a code address, the returned
+    // name is valid until the end of the process
+    bool find_function(const void* addr, const char*& name, const void*& start)
+    {
+        uint64_t vaddr, sym_start;
+        std::lock_guard<std::mutex> lock(_lock);
+        const module_debug* mod = find_module(addr, vaddr);
+
+        if(!mod || !mod->symbols->lookup(vaddr, name, sym_start))
+            return false;
+
+        start = static_cast<const char*>(addr) - (vaddr - sym_start);
+        return true;
+    }
+
+    // finds the source line for a code address, the returned
+    // file name is valid until the end of the process
+    bool find_line(const void* addr, const char*& file, int& line)
+    {
+        uint64_t vaddr;
+        std::lock_guard<std::mutex> lock(_lock);
+        const module_debug* mod = find_module(addr, vaddr);
+
+        return mod && mod->lines->lookup(vaddr, file, line);
+    }
+
+    // finds the calls inlined at a code address, the innermost one first;
+    // the returned names are valid until the end of the process
+    void find_inlined(const void* addr, std::vector<inline_table::call>& calls)
+    {
+        uint64_t vaddr;
+        std::lock_guard<std::mutex> lock(_lock);
+        const module_debug* mod = find_module(addr, vaddr);
+
+        if(mod)
+            mod->inlines->lookup(vaddr, calls);
+    }
+
+private:
+    debug_info()
+    {
+    }
+
+    struct module_debug
+    {
+        std::unique_ptr<elf_image> elf;
+        std::unique_ptr<elf_image> debug_elf;   // separate debug information
+        std::unique_ptr<symbol_table> symbols;
+        std::unique_ptr<line_table> lines;
+        std::unique_ptr<inline_table> inlines;
+    };
+
+    const module_debug* find_module(const void* addr, uint64_t& vaddr)
+    {
+        module_table& modules = module_table::get();
+        int idx = modules.find(addr);
+
+        if(idx < 0)
+            return nullptr;
+
+        const module_table::module& mod = modules[idx];
+        std::unique_ptr<module_debug>& debug = _modules[idx];
+
+        if(!debug)
+            debug = load(mod);
+
+        vaddr = reinterpret_cast<uintptr_t>(addr) - mod.base;
+        return debug.get();
+    }
+
+    static std::unique_ptr<module_debug> load(const module_table::module& mod)
+    {
+        std::unique_ptr<module_debug> debug(new module_debug());
+        debug->elf.reset(new elf_image(mod.path));
+        debug->symbols.reset(new symbol_table(*debug->elf));
+        debug->lines.reset(new line_table(*debug->elf));
+
+        // look for separate debug information if the module is stripped
+        if(debug->lines->empty() && mod.build_id.size() > 2)
+        {
+            std::string path = "/usr/lib/debug/.build-id/" + mod.build_id.substr(0, 2)
+                + "/" + mod.build_id.substr(2) + ".debug";
+            debug->debug_elf.reset(new elf_image(path));
+
+            if(debug->debug_elf->is_open())
+            {
+                debug->lines.reset(new line_table(*debug->debug_elf));
+                std::unique_ptr<symbol_table> symbols(new symbol_table(*debug->debug_elf));
+
+                if(!symbols->empty())
+                    debug->symbols = std::move(symbols);
+            }
+        }
+
+        const elf_image& lines_elf = debug->debug_elf && debug->debug_elf->is_open()
+            ? *debug->debug_elf : *debug->elf;
+        debug->inlines.reset(new inline_table(lines_elf, *debug->lines));
+
+        return debug;
+    }
+
+    std::mutex _lock;
+    std::map<int, std::unique_ptr<module_debug>> _modules;
+};
+
+// symbol information for a code address
+struct symbol_info
+{
+    const char* binary_name;
+    const char* func_name;
+    const char* demangled_func_name;
+    char        delta_sign;
+    long        delta;
+    const char* source_file_name;
+    int         line_number;
+    const symbol_info* inlined;     // function inlined at source_file_name:line_number
+};
+
+// resolves stack traces recorded in another process, given as module
+// offsets; modules are looked up in the debug directory by their build-id
+// (debug_dir/.build-id/xx/yyyy.debug) or file name, then at the recorded path
+class offline_symbolizer
+{
+public:
+    // an address recorded in a stack trace
+    struct frame
+    {
+        int module;
+        uint64_t offset;
+    };
+
+    explicit offline_symbolizer(const std::string& debug_dir = std::string())
+        : _debug_dir(debug_dir)
+    {
+    }
+
+    void add_module(int idx, const std::string& path, const std::string& build_id)
+    {
+        module& mod = _modules[idx];
+        mod.path = path;
+        mod.build_id = build_id;
+    }
+
+    const std::string& module_path(int idx)
+    {
+        static const std::string unknown("??");
+        auto it = _modules.find(idx);
+        return it != _modules.end() ? it->second.path : unknown;
+    }
+
+    // writes a line for each frame of a stack trace, preceded by the functions
+    // inlined in it: "[module+0xoffset] function in file:line"
+    void write_trace(std::ostream& out, const std::vector<frame>& frames,
+            const std::string& indent = std::string())
+    {
+        for(size_t i = 0; i < frames.size(); ++i)
+        {
+            const frame& fr = frames[i];
+            std::vector<std::string> inlined;
+            std::string func = resolve(fr.module, i > 0 ? fr.offset - 1 : fr.offset, &inlined);
+
+            for(const std::string& in : inlined)
+            {
+                out << indent << "[" << module_path(fr.module) << "+0x" << std::hex
+                    << fr.offset << std::dec << "] " << in << " (inlined)" << std::endl;
+            }
+
+            out << indent << "[" << module_path(fr.module) << "+0x" << std::hex
+                << fr.offset << std::dec << "] " << func << std::endl;
+        }
+    }
+
+    // returns "function in file:line"; return addresses point after the call
+    // instruction, so offsets of all frames but the first should be decremented.
+    // Functions inlined at the offset are stored in inlined, innermost first,
+    // the returned line is then the place where the outermost one was called.
+    std::string resolve(int idx, uint64_t offset, std::vector<std::string>* inlined = nullptr)
+    {
+        auto it = _modules.find(idx);
+
+        if(it == _modules.end())
+            return "?? in ??:0";
+
+        module& mod = it->second;
+
+        if(!mod.elf)
+            load(mod);
+
+        const char* name = "??";
+        const char* file = "??";
+        uint64_t start;
+        int line = 0;
+
+        if(mod.symbols)
+        {
+            mod.symbols->lookup(offset, name, start);
+            mod.lines->lookup(offset, file, line);
+        }
+
+        if(mod.inlines && inlined)
+        {
+            std::vector<inline_table::call> calls;
+            mod.inlines->lookup(offset, calls);
+
+            for(const inline_table::call& call : calls)
+            {
+                inlined->push_back(demangle(call.name) + " in " + file + ":" + std::to_string(line));
+                file = call.file;
+                line = call.line;
+            }
+        }
+
+        return demangle(name) + " in " + file + ":" + std::to_string(line);
+    }
+
+private:
+    struct module
+    {
+        std::string path;
+        std::string build_id;
+        std::unique_ptr<elf_image> elf;
+        std::unique_ptr<symbol_table> symbols;
+        std::unique_ptr<line_table> lines;
+        std::unique_ptr<inline_table> inlines;
+    };
+
+    void load(module& mod)
+    {
+        std::string path = module_file(mod);
+        mod.elf.reset(new elf_image(path));
+
+        if(!mod.elf->is_open())
+        {
+            std::cerr << "cannot read " << path << std::endl;
+            return;
+        }
+
+        mod.symbols.reset(new symbol_table(*mod.elf));
+        mod.lines.reset(new line_table(*mod.elf));
+        mod.inlines.reset(new inline_table(*mod.elf, *mod.lines));
+    }
+
+    // names point to the symbol tables and debug information, the same
+    // function is usually found at many addresses (and inlined in many places)
+    const std::string& demangle(const char* name)
+    {
+        auto it = _demangled.find(name);
+
+        if(it != _demangled.end())
+            return it->second;
+
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(name, 0, 0, &status);
+        std::string& result = _demangled[name];
+        result = demangled ? demangled : name;
+        free(demangled);
+        return result;
+    }
+
+    std::string module_file(const module& mod) const
+    {
+        if(!_debug_dir.empty())
+        {
+            if(mod.build_id.size() > 2)
+            {
+                std::string path = _debug_dir + "/.build-id/" + mod.build_id.substr(0, 2)
+                    + "/" + mod.build_id.substr(2) + ".debug";
+
+                if(access(path.c_str(), R_OK) == 0)
+                    return path;
+            }
+
+            std::string path = _debug_dir + "/" + mod.path.substr(mod.path.rfind('/') + 1);
+
+            if(access(path.c_str(), R_OK) == 0)
+                return path;
+        }
+
+        return mod.path;
+    }
+
+    std::string _debug_dir;
+    std::map<int, module> _modules;
+    std::unordered_map<const char*, std::string> _demangled;
+};
+
+// process-wide cache of resolved code addresses: each address is resolved
+// with dladdr() and demangled only once, and the binary and function names
+// are interned, so frames referring to the same code share the strings
+class symbol_cache
+{
+public:
+    static symbol_cache& get()
+    {
+        static symbol_cache* inst = new symbol_cache();
+        return *inst;
+    }
+
+    // returned information is valid until the end of the process
+    __attribute__((noinline))
+    const symbol_info& resolve(const void* addr)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto it = _symbols.find(addr);
+
+        if(it != _symbols.end())
+        {
+            ++_hits;
+            return *it->second;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        // the deque keeps the element address when new ones are appended
+        _infos.emplace_back(unknown());
+        symbol_info& sym = _infos.back();
+        Dl_info info;
+
+        if(::dladdr(addr, &info) != 0)
+        {
+            // the dynamic symbol table seen by dladdr() lacks static and
+            // hidden functions, unless the module is linked with -rdynamic
+            const void* start = nullptr;
+            const char* name = nullptr;
+
+            if(debug_info::get().find_function(addr, name, start))
+            {
+                info.dli_sname = name;
+                info.dli_saddr = const_cast<void*>(start);
+            }
+
+            sym.binary_name = intern(info.dli_fname);
+            sym.func_name   = intern(info.dli_sname);
+            sym.demangled_func_name = demangle(sym.func_name);
+            sym.delta_sign  = (addr >= info.dli_saddr) ? '+' : '-';
+            sym.delta = ::labs(static_cast<const char *>(addr) - static_cast<const char *>(info.dli_saddr));
+        }
+
+        // addresses in stack traces are return addresses, the call
+        // instruction (and the line that made the call) comes before
+        const void* call_addr = static_cast<const char*>(addr) - 1;
+        debug_info::get().find_line(call_addr, sym.source_file_name, sym.line_number);
+
+        // the line belongs to the innermost inlined function, each one was
+        // called from the next one, and the outermost from the function itself
+        std::vector<inline_table::call> calls;
+        debug_info::get().find_inlined(call_addr, calls);
+
+        for(const inline_table::call& call : calls)
+        {
+            _infos.emplace_back(sym);
+            symbol_info& in = _infos.back();
+            in.func_name = intern(call.name);
+            in.demangled_func_name = demangle(in.func_name);
+
+            sym.inlined = &in;
+            sym.source_file_name = call.file;
+            sym.line_number = call.line;
+        }
+
+        _symbols[addr] = &sym;
+        ++_misses;
+        _resolve_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        return sym;
+    }
+
+    // information for addresses that could not be resolved
+    static const symbol_info& unknown()
+    {
+        static const symbol_info sym = { nullptr, nullptr, nullptr, '+', 0L, nullptr, 0, nullptr };
+        return sym;
+    }
+
+    // number of lookups served from the cache, and the ones that had to be resolved
+    size_t hits() const             { return _hits; }
+    size_t misses() const           { return _misses; }
+
+    // time spent resolving addresses, and estimated time saved by the cache
+    uint64_t resolve_ns() const     { return _resolve_ns; }
+    uint64_t saved_ns() const
+    {
+        return _misses ? _hits * (_resolve_ns / _misses) : 0;
+    }
+
+private:
+    symbol_cache() : _hits(0), _misses(0), _resolve_ns(0)
+    {
+    }
+
+    const char* intern(const char* str)
+    {
+        if(!str)
+            return nullptr;
+
+        // set elements do not move, so the pointers remain valid
+        return _strings.insert(str).first->c_str();
+    }
+
+    // demangles an interned name, functions inlined in many
+    // places are demangled only once
+    const char* demangle(const char* name)
+    {
+        if(!name)
+            return nullptr;
+
+        auto it = _demangled.find(name);
+
+        if(it != _demangled.end())
+            return it->second;
+
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(name, 0, 0, &status);
+
+        // C functions and main() are not mangled
+        const char* result = demangled ? intern(demangled) : name;
+        free(demangled);
+        _demangled[name] = result;
+        return result;
+    }
+
+    std::mutex _lock;
+    flat_table<const void*, const symbol_info*> _symbols;
+    std::deque<symbol_info> _infos;
+    std::unordered_set<std::string> _strings;
+    flat_table<const char*, const char*> _demangled;
+
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+    std::atomic<uint64_t> _resolve_ns;
+};
+
+// the following class comes from:
+// https://en.wikibooks.org/wiki/Linux_Applications_Debugging_Techniques/The_call_stack
+class call_stack
+{
+public:
+    static const int depth = 40;
+    typedef std::array<void *, depth> stack_t;
+
+    class const_iterator;
+    class frame
+    {
+    public:
+        frame(void *addr = 0)
+                : _addr(0)
+                , _sym(&symbol_cache::unknown())
+        {
+            resolve(addr);
+        }
+
+        // frame(stack_t::iterator& it) : frame(*it) {} //C++0x
+        frame(stack_t::const_iterator const& it)
+                : _addr(0)
+                , _sym(&symbol_cache::unknown())
+        {
+            resolve(*it);
+        }
+
+        // resolved symbols are shared, so copies do not need to resolve again
+        frame(frame const& other)
+                : _addr(other._addr)
+                , _sym(other._sym)
+        {
+        }
+
+        frame& operator=(frame const& other)
+        {
+            _addr = other._addr;
+            _sym = other._sym;
+            return *this;
+        }
+
+        __attribute__((noinline))
+        std::string as_string() const
+        {
+            std::ostringstream s;
+
+            if(!symbolize())
+            {
+                // module offsets, to be resolved offline (see memcheck-symbolize)
+                module_table& modules = module_table::get();
+                int mod = modules.find(_addr);
+                s << "[" << std::hex << _addr << "] ("
+                  << (mod >= 0 ? modules[mod].path.c_str() : "??") << "+0x" << std::hex
+                  << reinterpret_cast<uintptr_t>(_addr) - (mod >= 0 ? modules[mod].base : 0) << ")";
+                return s.str();
+            }
+
+            // functions inlined at the address, the innermost one first
+            std::vector<const symbol_info*> inlined;
+
+            for(const symbol_info* in = _sym->inlined; in; in = in->inlined)
+                inlined.push_back(in);
+
+            for(auto it = inlined.rbegin(); it != inlined.rend(); ++it)
+            {
+                s << "[" << std::hex << _addr << "] " << safe((*it)->demangled_func_name)
+                  << " (inlined) in " << safe((*it)->source_file_name) << ":"
+                  << std::dec << (*it)->line_number << "\n";
+            }
+
+            s << "[" << std::hex << _addr << "] "
+              << demangled_function()
+              << " (" << binary_file() << delta_sign() << "0x" << std::hex << delta() << ")"
+              << " in " << source_file() << ":" << std::dec << line_number();
+            return s.str();
+        }
+
+        __attribute__((noinline))
+        const void* addr() const               { return _addr; }
+
+        __attribute__((noinline))
+        const char* binary_file() const        { return safe(_sym->binary_name); }
+
+        __attribute__((noinline))
+        const char* function() const           { return safe(_sym->func_name); }
+
+        __attribute__((noinline))
+        const char* demangled_function() const { return safe(_sym->demangled_func_name); }
+
+        __attribute__((noinline))
+        char        delta_sign() const         { return _sym->delta_sign; }
+
+        __attribute__((noinline))
+        long        delta() const              { return _sym->delta; }
+
+        __attribute__((noinline))
+        const char* source_file() const        { return safe(_sym->source_file_name); }
+
+        __attribute__((noinline))
+        int         line_number() const        { return  _sym->line_number; }
+
+    private:
+
+        const char* safe(const char* p) const { return p ? p : "??"; }
+
+        friend class const_iterator; // To call resolve()
+
+        void resolve(const void* addr)
+        {
+            if (_addr == addr)
+                return;
+
+            _addr = addr;
+            _sym = (_addr && symbolize()) ? &symbol_cache::get().resolve(_addr) : &symbol_cache::unknown();
+        }
+
+    private:
+
+        const void*         _addr;
+        const symbol_info*  _sym;
+    }; //frame
+
+
+    class const_iterator
+    {
+    public:
+        // std::iterator is deprecated, the same types are declared here
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef ptrdiff_t   value_type;
+        typedef ptrdiff_t   difference_type;
+        typedef ptrdiff_t*  pointer;
+        typedef ptrdiff_t&  reference;
+
+        const_iterator(stack_t::const_iterator const& it)
+                : _frame(it)
+                , _it(it)
+        {}
+
+        bool operator==(const const_iterator& other) const
+        {
+            return _frame.addr() == other._frame.addr();
+        }
+
+        bool operator!=(const const_iterator& x) const
+        {
+            return !(*this == x);
+        }
+
+        const frame& operator*() const
+        {
+            return _frame;
+        }
+        const frame* operator->() const
+        {
+            return &_frame;
+        }
+
+        const_iterator& operator++()
+        {
+            ++_it;
+            _frame.resolve(*_it);
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator tmp = *this;
+            ++_it;
+            _frame.resolve(*_it);
+            return tmp;
+        }
+
+        const_iterator& operator--()
+        {
+            --_it;
+            _frame.resolve(*_it);
+            return *this;
+        }
+        const_iterator operator--(int)
+        {
+            const_iterator tmp = *this;
+            --_it;
+            _frame.resolve(*_it);
+            return tmp;
+        }
+
+    private:
+        const_iterator();
+
+        frame                    _frame;
+        stack_t::const_iterator  _it;
+    }; //const_iterator
+
+
+    public:
+    // methods of capturing stack traces
+    enum class unwinder
+    {
+        backtrace,      // glibc backtrace(), works with any code, but it is slow
+        frame_pointer,  // walks the frame pointer chain, needs -fno-omit-frame-pointer
+        eh_frame        // uses cached .eh_frame unwind rules (x86-64 only)
+    };
+
+    call_stack() : _num_frames(0)
+    {
+        _num_frames = capture(_stack.data(), depth);
+        assert(_num_frames >= 0 && _num_frames <= depth);
+    }
+
+    // recreates a stack trace from previously captured frames
+    call_stack(void* const* frames, int num_frames) : _num_frames(num_frames)
+    {
+        assert(_num_frames >= 0 && _num_frames <= depth);
+        std::copy(frames, frames + num_frames, _stack.begin());
+    }
+
+    std::string as_string()
+    {
+        std::string s;
+        const_iterator itEnd = end();
+        for (const_iterator it = begin(); it != itEnd; ++it) {
+            s += it->as_string();
+            s += "\n";
+        }
+        return s;
+    }
+
+    virtual ~call_stack()
+    {
+    }
+
+    const_iterator begin() const { return _stack.cbegin(); }
+    const_iterator end() const   { return stack_t::const_iterator(&_stack[_num_frames]); }
+
+    void* const* frames() const  { return _stack.data(); }
+    int size() const             { return _num_frames; }
+
+    // selects the method used by all subsequently captured stack traces
+    static void set_unwinder(unwinder method)
+    {
+        selected_unwinder().store(method, std::memory_order_relaxed);
+    }
+
+    static unwinder get_unwinder()
+    {
+        return selected_unwinder().load(std::memory_order_relaxed);
+    }
+
+    // enables resolving symbols in the process, otherwise frames are shown
+    // as module offsets and never passed to dladdr()
+    static void set_symbolize(bool enable)
+    {
+        symbolize_flag().store(enable, std::memory_order_relaxed);
+    }
+
+    static bool symbolize()
+    {
+        return symbolize_flag().load(std::memory_order_relaxed);
+    }
+
+    // stores up to max_depth return addresses in frames, starting
+    // with the caller of capture(); returns the number of frames
+    __attribute__((noinline))
+    static int capture(void** frames, int max_depth, unwinder method = get_unwinder())
+    {
+        if(method == unwinder::frame_pointer)
+        {
+            int num_frames = walk_frame_pointers(frames, max_depth);
+
+            if(num_frames >= 0)
+                return num_frames;
+
+            // the chain is broken, let the slow but reliable method handle it
+        }
+#ifdef __x86_64__
+        else if(method == unwinder::eh_frame)
+        {
+            // starts with the return address to capture(), just like backtrace()
+            int num_frames = eh_frame_unwinder::get().unwind(frames, max_depth);
+
+            if(num_frames >= 0)
+                return num_frames;
+        }
+#endif
+
+        return ::backtrace(frames, max_depth);
+    }
+
+private:
+    static std::atomic<unwinder>& selected_unwinder()
+    {
+        static std::atomic<unwinder> method(unwinder::backtrace);
+        return method;
+    }
+
+    static std::atomic<bool>& symbolize_flag()
+    {
+        static std::atomic<bool> enabled(true);
+        return enabled;
+    }
+
+    __attribute__((noinline))
+    static void* return_address()
+    {
+        return __builtin_return_address(0);
+    }
+
+    // returns the number of captured frames, or -1 if the frame
+    // pointer chain does not look valid
+    __attribute__((always_inline))
+    static inline int walk_frame_pointers(void** frames, int max_depth)
+    {
+        uintptr_t low, high;
+        thread_stack_bounds(low, high);
+
+        if(max_depth <= 0)
+            return 0;
+
+        // mimic backtrace(), which starts with the function calling it
+        frames[0] = return_address();
+
+        // each frame starts with the caller frame pointer and return address
+        void* const* fp = static_cast<void* const*>(__builtin_frame_address(0));
+        int num_frames = 1;
+
+        while(num_frames < max_depth)
+        {
+            uintptr_t addr = reinterpret_cast<uintptr_t>(fp);
+
+            // a frame pointer has to be aligned and point inside the stack
+            if(addr % sizeof(void*) || addr < low || addr + 2 * sizeof(void*) > high)
+                break;
+
+            void* ret = fp[1];
+            void* const* next = static_cast<void* const*>(fp[0]);
+
+            if(!ret)
+                break;
+
+            frames[num_frames++] = ret;
+
+            // callers frames are always located higher on the stack, if this
+            // is not the case, the caller has been compiled without frame
+            // pointers (e.g. libc start up code) or the stack is corrupted
+            if(next <= fp)
+                break;
+
+            fp = next;
+        }
+
+        // the chain ended right in the code requesting the trace, so
+        // it has not been compiled with frame pointers
+        if(num_frames < 3 && num_frames < max_depth)
+            return -1;
+
+        return num_frames;
+    }
+
+    stack_t  _stack;
+    int      _num_frames;
+};
+
+// process-wide storage for stack traces: every distinct sequence of frames
+// is stored once and referred to by a 32-bit id, as most objects are created
+// and destroyed from a handful of places. The storage is split into shards
+// selected by the trace hash, so threads interning different traces rarely
+// wait for each other.
+class trace_store
+{
+public:
+    typedef uint32_t trace_id;
+    static const trace_id no_trace = 0;
+
+    static trace_store& get()
+    {
+        // never destroyed, for the same reason memcheck<T> instances are not
+        static trace_store* inst = new trace_store();
+        return *inst;
+    }
+
+    __attribute__((noinline))
+    trace_id intern(const call_stack& st)
+    {
+        void* const* frames = st.frames();
+        int num_frames = st.size();
+        uint64_t h = hash(frames, num_frames);
+
+        // traces captured repeatedly by a thread are found without locking,
+        // otherwise all threads creating objects in the same place would
+        // compete for the same shard
+        recent_trace& recent = recent_traces()[h % recent_count];
+
+        if(recent.id != no_trace && recent.hash == h && recent.num_frames == num_frames
+                && std::equal(frames, frames + num_frames, recent.frames))
+            return recent.id;
+
+        uint32_t shard_idx = h % shard_count;
+        shard& sh = _shards[shard_idx];
+        trace_id id = no_trace;
+
+        {
+            std::lock_guard<std::mutex> lock(sh.lock);
+            uint32_t& head = sh.by_hash[h];
+
+            for(uint32_t idx = head; idx != 0; idx = sh.traces[idx].next)
+            {
+                const trace& tr = sh.traces[idx];
+
+                if(tr.num_frames == num_frames
+                        && std::equal(frames, frames + num_frames, &sh.frames[tr.offset]))
+                {
+                    id = make_id(shard_idx, idx);
+                    break;
+                }
+            }
+
+            if(id == no_trace)
+            {
+                trace tr;
+                tr.offset = sh.frames.size();
+                tr.num_frames = num_frames;
+                tr.next = head;
+                sh.frames.insert(sh.frames.end(), frames, frames + num_frames);
+                sh.traces.push_back(tr);
+
+                head = sh.traces.size() - 1;
+                id = make_id(shard_idx, head);
+            }
+        }
+
+        recent.id = id;
+        recent.hash = h;
+        recent.num_frames = num_frames;
+        std::copy(frames, frames + num_frames, recent.frames);
+        return id;
+    }
+
+    // captures the current stack trace and stores it
+    trace_id capture()
+    {
+        return intern(call_stack());
+    }
+
+    // captures at most max_depth frames of the current stack trace
+    trace_id capture(int max_depth)
+    {
+        if(max_depth >= call_stack::depth)
+            return capture();
+
+        void* frames[call_stack::depth];
+        return intern(call_stack(frames, call_stack::capture(frames, max_depth)));
+    }
+
+    call_stack stack(trace_id id) const
+    {
+        assert(id != no_trace);
+        const shard& sh = _shards[id % shard_count];
+
+        std::lock_guard<std::mutex> lock(sh.lock);
+        assert(id / shard_count < sh.traces.size());
+        const trace& tr = sh.traces[id / shard_count];
+        return call_stack(&sh.frames[tr.offset], tr.num_frames);
+    }
+
+    // number of distinct stack traces
+    size_t size() const
+    {
+        size_t count = 0;
+
+        for(const shard& sh : _shards)
+        {
+            std::lock_guard<std::mutex> lock(sh.lock);
+            count += sh.traces.size() - 1;
+        }
+
+        return count;
+    }
+
+    // memory used to store the traces, in bytes
+    size_t memory() const
+    {
+        size_t bytes = 0;
+
+        for(const shard& sh : _shards)
+        {
+            std::lock_guard<std::mutex> lock(sh.lock);
+            bytes += sh.frames.capacity() * sizeof(void*)
+                + sh.traces.capacity() * sizeof(trace)
+                + sh.by_hash.memory();
+        }
+
+        return bytes;
+    }
+
+private:
+    trace_store()
+    {
+    }
+
+    static const uint32_t shard_count = 16;
+    static const uint32_t recent_count = 32;
+
+    // a trace recently interned by the current thread
+    struct recent_trace
+    {
+        trace_id id;
+        int num_frames;
+        uint64_t hash;
+        void* frames[call_stack::depth];
+    };
+
+    static recent_trace* recent_traces()
+    {
+        // allocated on first use, so threads that do not capture
+        // stack traces do not pay for it
+        static thread_local std::unique_ptr<recent_trace[]> recent;
+
+        if(!recent)
+            recent.reset(new recent_trace[recent_count]());
+
+        return recent.get();
+    }
+
+    struct trace
+    {
+        trace() : offset(0), num_frames(0), next(0) {}
+
+        uint32_t offset;        // index of the first frame in shard frames
+        int      num_frames;
+        uint32_t next;          // previous trace with the same hash
+    };
+
+    struct alignas(64) shard
+    {
+        shard() : traces(1)     // index 0 is reserved for no_trace
+        {
+        }
+
+        mutable std::mutex lock;
+        std::vector<void*> frames;
+        std::vector<trace> traces;
+        flat_table<uint64_t, uint32_t> by_hash;
+    };
+
+    // the shard is stored in the lowest bits, traces are numbered from 1,
+    // so a valid id is never equal to no_trace
+    static trace_id make_id(uint32_t shard_idx, uint32_t idx)
+    {
+        return idx * shard_count + shard_idx;
+    }
+
+    static uint64_t hash(void* const* frames, int num_frames)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for(int i = 0; i < num_frames; ++i)
+        {
+            h ^= reinterpret_cast<uintptr_t>(frames[i]);
+            h *= 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+
+        return h;
+    }
+
+    shard _shards[shard_count];
+};
+
+// a cheap, monotonic timestamp comparable between threads
+// (time stamp counter ticks when available)
+inline uint64_t timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// timestamp() ticks per second, measured once
+inline uint64_t timestamp_frequency()
+{
+    static uint64_t frequency = []() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t ticks = timestamp();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ticks = timestamp() - ticks;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return uint64_t(ticks / elapsed.count());
+    }();
+
+    return frequency;
+}
+
+// kinds of records in a binary event stream; each record starts with its
+// kind byte, followed by fields in the native byte order
+enum class stream_record : uint8_t
+{
+    module = 1,     // u32 index, u64 base, u16 length + build-id, u16 length + path
+    type,           // u32 type id, u16 length + name
+    trace,          // u32 trace id, u16 frame count, frames as (i32 module, u64 offset)
+    created,        // stream_event
+    destroyed,      // stream_event
+    clock           // u64 timestamp() ticks per second
+};
+
+// payload of created and destroyed records
+struct stream_event
+{
+    uint32_t type;
+    uint32_t trace;
+    uint32_t thread;
+    uint32_t reserved;
+    uint64_t obj;
+    uint64_t time;      // timestamp() ticks
+    uint64_t size;      // 0 for destroyed objects
+};
+
+// encodes records of the binary event stream format; frames of stack traces
+// are stored as module offsets, and modules are encoded before the first
+// trace referring to them
+class stream_encoder
+{
+public:
+    static const uint32_t version = 2;
+
+    stream_encoder() : _modules_written(0)
+    {
+    }
+
+    // magic, format version and the clock record
+    void header(std::vector<char>& buf)
+    {
+        uint32_t ver = version;
+        uint64_t frequency = timestamp_frequency();
+        put(buf, "MEMCHECK", 8);
+        put(buf, &ver, sizeof(ver));
+        put_kind(buf, stream_record::clock);
+        put(buf, &frequency, sizeof(frequency));
+    }
+
+    void type(std::vector<char>& buf, uint32_t id, const std::string& name)
+    {
+        uint16_t len = name.size();
+
+        put_kind(buf, stream_record::type);
+        put(buf, &id, sizeof(id));
+        put(buf, &len, sizeof(len));
+        put(buf, name.data(), len);
+    }
+
+    void trace(std::vector<char>& buf, trace_store::trace_id id)
+    {
+        call_stack st = trace_store::get().stack(id);
+        module_table& modules = module_table::get();
+        int mods[call_stack::depth];
+
+        for(int i = 0; i < st.size(); ++i)
+            mods[i] = modules.find(st.frames()[i]);
+
+        for(; _modules_written < modules.size(); ++_modules_written)
+        {
+            const module_table::module& mod = modules[_modules_written];
+            uint32_t idx = _modules_written;
+            uint64_t base = mod.base;
+            uint16_t id_len = mod.build_id.size();
+            uint16_t path_len = mod.path.size();
+
+            put_kind(buf, stream_record::module);
+            put(buf, &idx, sizeof(idx));
+            put(buf, &base, sizeof(base));
+            put(buf, &id_len, sizeof(id_len));
+            put(buf, mod.build_id.data(), id_len);
+            put(buf, &path_len, sizeof(path_len));
+            put(buf, mod.path.data(), path_len);
+        }
+
+        uint16_t num_frames = st.size();
+        put_kind(buf, stream_record::trace);
+        put(buf, &id, sizeof(id));
+        put(buf, &num_frames, sizeof(num_frames));
+
+        for(int i = 0; i < st.size(); ++i)
+        {
+            int32_t mod = mods[i];
+            uint64_t offset = reinterpret_cast<uintptr_t>(st.frames()[i])
+                - (mod >= 0 ? modules[mod].base : 0);
+
+            put(buf, &mod, sizeof(mod));
+            put(buf, &offset, sizeof(offset));
+        }
+    }
+
+    static void event(std::vector<char>& buf, bool created, const stream_event& ev)
+    {
+        put_kind(buf, created ? stream_record::created : stream_record::destroyed);
+        put(buf, &ev, sizeof(ev));
+    }
+
+private:
+    static void put_kind(std::vector<char>& buf, stream_record kind)
+    {
+        put(buf, &kind, sizeof(kind));
+    }
+
+    static void put(std::vector<char>& buf, const void* data, size_t len)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        buf.insert(buf.end(), bytes, bytes + len);
+    }
+
+    size_t _modules_written;
+};
+
+// writes lifetime events to a compact binary log, so the tracked process
+// does not have to keep them; stack traces and modules are written once,
+// before the first event referring to them. Each thread encodes its events
+// in its own buffer, the stream lock is taken only to write a trace seen
+// by the thread for the first time and to write a full buffer. Events are
+// ordered by time within a thread, but the buffers of different threads are
+// interleaved, so e.g. a destruction may precede the construction done by
+// another thread; readers match the events by object address.
+class event_stream
+{
+public:
+    static const uint32_t version = stream_encoder::version;
+
+    event_stream() : _fd(-1), _id(0), _next_type(1)
+    {
+    }
+
+    ~event_stream()
+    {
+        close();
+    }
+
+    event_stream(const event_stream&) = delete;
+    event_stream& operator=(const event_stream&) = delete;
+
+    bool open(const char* path)
+    {
+        close();
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if(fd < 0)
+            return false;
+
+        // buffers of the previously opened file are not used anymore
+        static std::atomic<uint64_t> next_id(1);
+        _id.store(next_id.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _fd = fd;
+        _encoder = stream_encoder();
+        _traces_written.clear();
+        _encoder.header(_buf);
+        return true;
+    }
+
+    // the thread buffers are detached even if the stream has not been
+    // opened, so the threads do not refer to it anymore
+    void close()
+    {
+        flush(true);
+
+        // other threads may be writing their buffers meanwhile
+        std::lock_guard<std::mutex> lock(_lock);
+
+        if(_fd < 0)
+            return;
+
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    bool is_open() const
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _fd >= 0;
+    }
+
+    // writes the buffered records of all threads
+    void flush()
+    {
+        flush(false);
+    }
+
+    // returns an id used for events of a type
+    uint32_t add_type(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        uint32_t id = _next_type++;
+        _encoder.type(_buf, id, name);
+        return id;
+    }
+
+    void write_event(uint32_t type, bool created, const void* obj,
+            trace_store::trace_id trace, size_t size)
+    {
+        stream_event ev = { type, trace, thread_id(), 0,
+            reinterpret_cast<uintptr_t>(obj), timestamp(), size };
+
+        thread_buffer& buf = this_thread_buffer();
+
+        // taken only by this thread, unless the stream is being flushed
+        std::lock_guard<std::mutex> buf_lock(buf.lock);
+
+        // the stream has been closed, nobody would write the buffer
+        if(!buf.stream)
+            return;
+
+        if(trace != trace_store::no_trace && !buf.traces[trace])
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+
+            if(!_traces_written[trace])
+            {
+                _encoder.trace(_buf, trace);
+                _traces_written[trace] = true;
+            }
+
+            buf.traces[trace] = true;
+        }
+
+        stream_encoder::event(buf.data, created, ev);
+
+        if(buf.data.size() >= buffer_size)
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            write_buffers(&buf.data);
+        }
+    }
+
+    // kernel thread id, cached
+    static uint32_t thread_id()
+    {
+        static thread_local uint32_t tid = 0;
+
+        if(tid == 0)
+            tid = syscall(SYS_gettid);
+
+        return tid;
+    }
+
+private:
+    // events encoded by a thread, shared by the thread and the stream,
+    // so whichever goes first does not leave the other one with a dangling
+    // pointer; lock has to be taken before the stream lock
+    struct thread_buffer
+    {
+        thread_buffer(event_stream* stream, uint64_t id) : stream(stream), id(id)
+        {
+            data.reserve(buffer_size);
+        }
+
+        std::mutex lock;
+        event_stream* stream;       // nullptr once the stream is closed
+        uint64_t id;                // of the opened stream
+        std::vector<char> data;
+        flat_table<trace_store::trace_id, bool> traces;     // written by the stream
+    };
+
+    // buffers of a thread, flushed when the thread exits
+    struct thread_buffers
+    {
+        ~thread_buffers()
+        {
+            for(const std::shared_ptr<thread_buffer>& buf : list)
+            {
+                std::lock_guard<std::mutex> buf_lock(buf->lock);
+
+                if(buf->stream)
+                {
+                    std::lock_guard<std::mutex> lock(buf->stream->_lock);
+                    buf->stream->write_buffers(&buf->data);
+                }
+
+                std::vector<char>().swap(buf->data);
+            }
+        }
+
+        std::vector<std::shared_ptr<thread_buffer>> list;
+    };
+
+    thread_buffer& this_thread_buffer()
+    {
+        static thread_local thread_buffers buffers;
+
+        uint64_t id = _id.load(std::memory_order_relaxed);
+
+        for(const std::shared_ptr<thread_buffer>& buf : buffers.list)
+        {
+            if(buf->id == id)
+                return *buf;
+        }
+
+        // buffers of closed streams are dropped
+        buffers.list.erase(std::remove_if(buffers.list.begin(), buffers.list.end(),
+                [](const std::shared_ptr<thread_buffer>& buf) {
+                    std::lock_guard<std::mutex> buf_lock(buf->lock);
+                    return buf->stream == nullptr;
+                }), buffers.list.end());
+
+        std::shared_ptr<thread_buffer> buf = std::make_shared<thread_buffer>(this, id);
+        buffers.list.push_back(buf);
+
+        std::lock_guard<std::mutex> lock(_buffers_lock);
+        _buffers.push_back(buf);
+        return *buf;
+    }
+
+    // writes the buffers of all threads, detaches them if the stream is closed
+    void flush(bool detach)
+    {
+        std::vector<std::shared_ptr<thread_buffer>> buffers;
+
+        {
+            std::lock_guard<std::mutex> lock(_buffers_lock);
+            buffers = _buffers;
+
+            if(detach)
+                _buffers.clear();
+        }
+
+        for(const std::shared_ptr<thread_buffer>& buf : buffers)
+        {
+            std::lock_guard<std::mutex> buf_lock(buf->lock);
+            std::lock_guard<std::mutex> lock(_lock);
+            write_buffers(&buf->data);
+
+            if(detach)
+                buf->stream = nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(_lock);
+        write_buffers(nullptr);
+    }
+
+    // writes the shared records (types, traces and modules) followed by
+    // the events of a thread, so the records the events refer to come first;
+    // _lock has to be held
+    void write_buffers(std::vector<char>* events)
+    {
+        struct iovec iov[2] = {
+            { _buf.data(), _buf.size() },
+            { events ? events->data() : nullptr, events ? events->size() : 0 }
+        };
+        int first = 0;
+
+        while(_fd >= 0 && first < 2)
+        {
+            ssize_t len = writev(_fd, iov + first, 2 - first);
+
+            if(len < 0 && errno == EINTR)
+                continue;
+
+            if(len <= 0)
+                break;
+
+            // skip the written buffers, the last one might be written partially
+            for(; first < 2 && size_t(len) >= iov[first].iov_len; ++first)
+                len -= iov[first].iov_len;
+
+            if(first < 2)
+            {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + len;
+                iov[first].iov_len -= len;
+            }
+        }
+
+        _buf.clear();
+
+        if(events)
+            events->clear();
+    }
+
+    static const size_t buffer_size = 64 * 1024;
+
+    mutable std::mutex _lock;
+    int _fd;
+    std::atomic<uint64_t> _id;
+    std::vector<char> _buf;         // records shared by all threads
+    stream_encoder _encoder;
+    uint32_t _next_type;
+    flat_table<trace_store::trace_id, bool> _traces_written;
+
+    std::mutex _buffers_lock;
+    std::vector<std::shared_ptr<thread_buffer>> _buffers;
+};
+
+// reads logs written by event_stream; module, type and trace records are
+// collected while reading, so they are known when an event refers to them
+class event_stream_reader
+{
+public:
+    struct module
+    {
+        std::string path;
+        std::string build_id;
+        uint64_t base;
+    };
+
+    typedef offline_symbolizer::frame frame;
+
+    struct event
+    {
+        bool created;
+        stream_event data;
+    };
+
+    explicit event_stream_reader(std::istream& in) : _in(in), _valid(false), _frequency(0)
+    {
+        char magic[8];
+        uint32_t version = 0;
+
+        if(get(magic, sizeof(magic)) && get(&version, sizeof(version)))
+            _valid = memcmp(magic, "MEMCHECK", 8) == 0 && version == event_stream::version;
+    }
+
+    bool valid() const
+    {
+        return _valid;
+    }
+
+    // reads records up to the next event, returns false at the end of the log
+    bool next(event& ev)
+    {
+        uint8_t kind;
+
+        while(_valid && get(&kind, sizeof(kind)))
+        {
+            switch(static_cast<stream_record>(kind))
+            {
+                case stream_record::module:
+                {
+                    uint32_t idx;
+                    module mod;
+
+                    if(!get(&idx, sizeof(idx)) || !get(&mod.base, sizeof(mod.base))
+                            || !get_string(mod.build_id) || !get_string(mod.path))
+                        return false;
+
+                    if(_modules.size() <= idx)
+                        _modules.resize(idx + 1);
+
+                    _modules[idx] = mod;
+                    break;
+                }
+
+                case stream_record::type:
+                {
+                    uint32_t id;
+
+                    if(!get(&id, sizeof(id)) || !get_string(_types[id]))
+                        return false;
+
+                    break;
+                }
+
+                case stream_record::trace:
+                {
+                    uint32_t id;
+                    uint16_t num_frames;
+
+                    if(!get(&id, sizeof(id)) || !get(&num_frames, sizeof(num_frames)))
+                        return false;
+
+                    std::vector<frame>& frames = _traces[id];
+                    frames.resize(num_frames);
+
+                    for(frame& fr : frames)
+                    {
+                        int32_t mod;
+
+                        if(!get(&mod, sizeof(mod)) || !get(&fr.offset, sizeof(fr.offset)))
+                            return false;
+
+                        fr.module = mod;
+                    }
+
+                    break;
+                }
+
+                case stream_record::clock:
+                    if(!get(&_frequency, sizeof(_frequency)))
+                        return false;
+
+                    break;
+
+                case stream_record::created:
+                case stream_record::destroyed:
+                    ev.created = static_cast<stream_record>(kind) == stream_record::created;
+                    return get(&ev.data, sizeof(ev.data));
+
+                default:
+                    _valid = false;     // corrupted log
+                    return false;
+            }
+        }
+
+        return false;
+    }
+
+    const std::vector<module>& modules() const                      { return _modules; }
+    const std::map<uint32_t, std::string>& types() const            { return _types; }
+    const std::map<uint32_t, std::vector<frame>>& traces() const    { return _traces; }
+
+    // timestamp ticks per second in the process that wrote the log
+    uint64_t frequency() const                                      { return _frequency; }
+
+private:
+    bool get(void* data, size_t len)
+    {
+        return static_cast<bool>(_in.read(static_cast<char*>(data), len));
+    }
+
+    bool get_string(std::string& str)
+    {
+        uint16_t len;
+
+        if(!get(&len, sizeof(len)))
+            return false;
+
+        str.resize(len);
+        return len == 0 || get(&str[0], len);
+    }
+
+    std::istream& _in;
+    bool _valid;
+    std::vector<module> _modules;
+    std::map<uint32_t, std::string> _types;
+    std::map<uint32_t, std::vector<frame>> _traces;
+    uint64_t _frequency;
+};
+
+// registry of existing objects kept in a memory-mapped file, so it survives
+// a crash of the process and can be read afterwards (see memcheck-postmortem).
+// The file holds a header, a fixed size open addressing table of objects and
+// an event stream (without events) describing modules, types and stack traces;
+// there are no pointers in it, objects refer to traces by their ids.
+// Registering an object takes an atomic exchange and a few stores, a trace is
+// appended (under a lock) only the first time it is seen.
+class mapped_registry
+{
+public:
+    static const uint32_t version = 1;
+
+    struct header
+    {
+        char magic[8];                      // "MEMCHKRG"
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t pid;
+        uint64_t start_time;                // timestamp() when the file was created
+        uint64_t slot_offset;               // from the beginning of the file
+        uint64_t slot_count;
+        uint64_t records_offset;
+        uint64_t records_capacity;
+        std::atomic<uint64_t> records_size; // complete records
+        std::atomic<uint64_t> dropped;      // objects that did not fit in the table
+    };
+
+    // an existing object, the key combines its type id and address
+    struct slot
+    {
+        std::atomic<uint64_t> key;
+        uint32_t trace;
+        uint32_t reserved;
+        uint64_t size;
+        uint64_t time;                      // timestamp() of the creation
+    };
+
+    // keys of slots that have never been used and slots of destroyed objects
+    static const uint64_t empty_key = 0;
+    static const uint64_t removed_key = 1;
+
+    // user space addresses take 48 bits, type ids use the rest
+    static const int address_bits = 48;
+
+    mapped_registry() : _map(nullptr), _map_size(0), _header(nullptr), _slots(nullptr),
+        _next_type(1)
+    {
+    }
+
+    ~mapped_registry()
+    {
+        close();
+    }
+
+    mapped_registry(const mapped_registry&) = delete;
+    mapped_registry& operator=(const mapped_registry&) = delete;
+
+    // creates the file with room for max_objects existing objects
+    // and records_capacity bytes of modules, types and traces
+    bool open(const char* path, size_t max_objects = 1 << 20,
+            size_t records_capacity = 16 << 20)
+    {
+        close();
+
+        size_t slot_count = 1;
+
+        // the table is kept at most half full, so the probes are short
+        while(slot_count < 2 * max_objects)
+            slot_count *= 2;
+
+        size_t slot_offset = (sizeof(header) + 63) & ~size_t(63);
+        size_t records_offset = slot_offset + slot_count * sizeof(slot);
+        size_t size = records_offset + records_capacity;
+
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if(fd < 0)
+            return false;
+
+        if(ftruncate(fd, size) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if(map == MAP_FAILED)
+            return false;
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _map = static_cast<char*>(map);
+        _map_size = size;
+        _slots = reinterpret_cast<slot*>(_map + slot_offset);
+        _traces_written.reset(new std::atomic<uint32_t>[trace_index_size]());
+
+        // the file is zeroed, so all slots are empty
+        _header = new(_map) header();
+        memcpy(_header->magic, "MEMCHKRG", 8);
+        _header->version = version;
+        _header->header_size = sizeof(header);
+        _header->pid = getpid();
+        _header->start_time = timestamp();
+        _header->slot_offset = slot_offset;
+        _header->slot_count = slot_count;
+        _header->records_offset = records_offset;
+        _header->records_capacity = records_capacity;
+
+        _encoder.header(_buf);
+        append();
+        return true;
+    }
+
+    // unmaps the file, it is left on the disk
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        if(!_map)
+            return;
+
+        munmap(_map, _map_size);
+        _map = nullptr;
+        _header = nullptr;
+        _slots = nullptr;
+    }
+
+    bool is_open() const
+    {
+        return _map != nullptr;
+    }
+
+    // returns an id used for objects of a type
+    uint32_t add_type(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        uint32_t id = _next_type++;
+        assert(id < (1U << (64 - address_bits)));
+        _encoder.type(_buf, id, name);
+        append();
+        return id;
+    }
+
+    void created(uint32_t type, const void* obj, trace_store::trace_id trace, size_t size)
+    {
+        if(trace != trace_store::no_trace && !write_trace(trace))
+            trace = trace_store::no_trace;
+
+        uint64_t key = make_key(type, obj);
+        uint64_t mask = _header->slot_count - 1;
+        uint64_t idx = hash(key);
+
+        for(int i = 0; i < max_probes; ++i, ++idx)
+        {
+            slot& sl = _slots[idx & mask];
+            uint64_t free = sl.key.load(std::memory_order_relaxed);
+
+            if(free != empty_key && free != removed_key)
+                continue;
+
+            // a crash between claiming the slot and filling it leaves
+            // the object with the fields of a previous one
+            if(sl.key.compare_exchange_strong(free, key, std::memory_order_relaxed))
+            {
+                sl.trace = trace;
+                sl.size = size;
+                sl.time = timestamp();
+                return;
+            }
+        }
+
+        _header->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void destroyed(uint32_t type, const void* obj)
+    {
+        uint64_t key = make_key(type, obj);
+        uint64_t mask = _header->slot_count - 1;
+        uint64_t idx = hash(key);
+
+        for(int i = 0; i < max_probes; ++i, ++idx)
+        {
+            slot& sl = _slots[idx & mask];
+            uint64_t current = sl.key.load(std::memory_order_relaxed);
+
+            // objects are registered in the first free slot, so the search
+            // stops at a slot that has never been used
+            if(current == empty_key)
+                return;
+
+            if(current == key)
+            {
+                sl.key.store(removed_key, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    static uint64_t make_key(uint32_t type, const void* obj)
+    {
+        return uint64_t(type) << address_bits | reinterpret_cast<uintptr_t>(obj);
+    }
+
+private:
+    static const int max_probes = 64;
+    static const size_t trace_index_size = 1 << 18;
+
+    static uint64_t hash(uint64_t key)
+    {
+        return (key * 0x9e3779b97f4a7c15ULL) >> 20;
+    }
+
+    // makes sure the trace is in the file, returns false if there is no room
+    bool write_trace(trace_store::trace_id id)
+    {
+        size_t idx = hash(id) % trace_index_size;
+        int probe = 0;
+
+        for(; probe < max_probes; ++probe)
+        {
+            uint32_t written = _traces_written[(idx + probe) % trace_index_size]
+                    .load(std::memory_order_acquire);
+
+            if(written == id)
+                return true;
+
+            if(written == trace_store::no_trace)
+                break;
+        }
+
+        if(probe == max_probes)
+            return false;
+
+        std::lock_guard<std::mutex> lock(_lock);
+
+        // another thread might have written it in the meantime
+        for(; probe < max_probes; ++probe)
+        {
+            std::atomic<uint32_t>& written = _traces_written[(idx + probe) % trace_index_size];
+
+            if(written.load(std::memory_order_relaxed) == id)
+                return true;
+
+            if(written.load(std::memory_order_relaxed) == trace_store::no_trace)
+            {
+                _encoder.trace(_buf, id);
+
+                if(!append())
+                    return false;
+
+                written.store(id, std::memory_order_release);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // copies the encoded records to the file and publishes them;
+    // _lock has to be held
+    bool append()
+    {
+        uint64_t size = _header->records_size.load(std::memory_order_relaxed);
+        bool fits = size + _buf.size() <= _header->records_capacity;
+
+        if(fits)
+        {
+            memcpy(_map + _header->records_offset + size, _buf.data(), _buf.size());
+            _header->records_size.store(size + _buf.size(), std::memory_order_release);
+        }
+
+        _buf.clear();
+        return fits;
+    }
+
+    std::mutex _lock;
+    char* _map;
+    size_t _map_size;
+    header* _header;
+    slot* _slots;
+
+    // ids of traces already in the file, checked without locking
+    std::unique_ptr<std::atomic<uint32_t>[]> _traces_written;
+
+    stream_encoder _encoder;
+    std::vector<char> _buf;
+    uint32_t _next_type;
+};
+
+// reads a file written by mapped_registry, also while the process is running
+class mapped_registry_reader
+{
+public:
+    struct object
+    {
+        uint32_t type;
+        uint32_t trace;
+        uint64_t obj;
+        uint64_t size;
+        uint64_t time;      // timestamp() ticks since the file was created
+    };
+
+    explicit mapped_registry_reader(const char* path)
+        : _valid(false), _pid(0), _dropped(0)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        _records.reset(new event_stream_reader(_in));
+
+        if(fd < 0)
+            return;
+
+        if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(mapped_registry::header))
+        {
+            ::close(fd);
+            return;
+        }
+
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if(map == MAP_FAILED)
+            return;
+
+        read(static_cast<const char*>(map), st.st_size);
+        munmap(map, st.st_size);
+    }
+
+    bool valid() const
+    {
+        return _valid;
+    }
+
+    const std::vector<object>& objects() const  { return _objects; }
+    uint64_t pid() const                        { return _pid; }
+    uint64_t dropped() const                    { return _dropped; }
+
+    // modules, types and traces
+    const event_stream_reader& records() const  { return *_records; }
+
+private:
+    void read(const char* map, size_t size)
+    {
+        const mapped_registry::header* hdr =
+            reinterpret_cast<const mapped_registry::header*>(map);
+
+        if(memcmp(hdr->magic, "MEMCHKRG", 8) != 0 || hdr->version != mapped_registry::version
+                || hdr->header_size != sizeof(mapped_registry::header)
+                || hdr->slot_offset + hdr->slot_count * sizeof(mapped_registry::slot) > size
+                || hdr->records_offset + hdr->records_capacity > size)
+            return;
+
+        uint64_t records_size = std::min(hdr->records_size.load(), hdr->records_capacity);
+        _in.str(std::string(map + hdr->records_offset, records_size));
+        _in.clear();
+        _records.reset(new event_stream_reader(_in));
+
+        // there are no events, so all records are read at once
+        event_stream_reader::event ev;
+
+        while(_records->next(ev))
+            ;
+
+        const mapped_registry::slot* slots =
+            reinterpret_cast<const mapped_registry::slot*>(map + hdr->slot_offset);
+        const uint64_t address_mask = (1ULL << mapped_registry::address_bits) - 1;
+
+        for(uint64_t i = 0; i < hdr->slot_count; ++i)
+        {
+            uint64_t key = slots[i].key.load(std::memory_order_relaxed);
+
+            if(key == mapped_registry::empty_key || key == mapped_registry::removed_key)
+                continue;
+
+            object obj = { uint32_t(key >> mapped_registry::address_bits), slots[i].trace,
+                key & address_mask, slots[i].size,
+                slots[i].time > hdr->start_time ? slots[i].time - hdr->start_time : 0 };
+            _objects.push_back(obj);
+        }
+
+        _pid = hdr->pid;
+        _dropped = hdr->dropped.load();
+        _valid = _records->valid();
+    }
+
+    bool _valid;
+    uint64_t _pid;
+    uint64_t _dropped;
+    std::vector<object> _objects;
+    std::istringstream _in;
+    std::unique_ptr<event_stream_reader> _records;
+};
+
+// writes reports from a dedicated thread, so the threads asking for them
+// neither wait for the output nor for symbol resolution, and reports do not
+// interleave with each other. Messages are passed through a bounded lock-free
+// queue; the writer formats them and writes them in batches with writev().
+// When the queue is full, senders either wait or drop their messages.
+class report_writer
+{
+public:
+    // writes a message, called by the writer thread
+    typedef std::function<void(std::ostream&)> message;
+
+    enum class overflow
+    {
+        block,      // the sender waits until there is room
+        drop        // the message is dropped and counted
+    };
+
+    static report_writer& get()
+    {
+        // never destroyed, reports may be sent until the very end
+        static report_writer* inst = new report_writer();
+        return *inst;
+    }
+
+    // starts the writer thread writing to a file descriptor,
+    // the queue has room for capacity (rounded up to a power of two) messages
+    void start(int fd = STDOUT_FILENO, size_t capacity = 1024, overflow policy = overflow::block)
+    {
+        stop();
+
+        size_t size = 1;
+
+        while(size < capacity)
+            size *= 2;
+
+        _cells.reset(new cell[size]);
+        _mask = size - 1;
+
+        for(size_t i = 0; i < size; ++i)
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+
+        _head.store(0, std::memory_order_relaxed);
+        _tail = 0;
+        _written.store(0, std::memory_order_relaxed);
+        _fd = fd;
+        _policy = policy;
+        _stopping.store(false, std::memory_order_relaxed);
+        _running.store(true, std::memory_order_release);
+        _thread = std::thread([this]() { run(); });
+
+        // the queued reports are written before the process exits
+        static bool at_exit = (atexit([]() { get().stop(); }) == 0);
+        (void) at_exit;
+    }
+
+    // writes the queued messages and stops the thread
+    void stop()
+    {
+        if(!_thread.joinable())
+            return;
+
+        // senders that have seen the writer running queue their messages
+        // before the writer is told to finish, so none of them is lost
+        _running.store(false, std::memory_order_seq_cst);
+
+        while(_senders.load(std::memory_order_seq_cst) != 0)
+            std::this_thread::yield();
+
+        _stopping.store(true, std::memory_order_release);
+        wake();
+        _thread.join();
+    }
+
+    bool running() const
+    {
+        return _running.load(std::memory_order_acquire);
+    }
+
+    // queues a message, returns false if it has been dropped or the writer
+    // is not running; msg is moved from only when it is queued
+    bool send(message&& msg)
+    {
+        _senders.fetch_add(1, std::memory_order_seq_cst);
+        bool queued = _running.load(std::memory_order_seq_cst) && enqueue(msg);
+        _senders.fetch_sub(1, std::memory_order_release);
+        return queued;
+    }
+
+    bool send(const message& msg)
+    {
+        return send(message(msg));
+    }
+
+    // queues a text, returns false if it has been dropped
+    bool send(std::string text)
+    {
+        return send(message([text](std::ostream& out) { out << text; }));
+    }
+
+    // waits until the messages queued so far are written
+    void flush()
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+
+        wait_progress([this, head]() {
+            return !running() || _written.load(std::memory_order_acquire) >= head;
+        });
+    }
+
+    // messages dropped because the queue was full
+    uint64_t dropped() const        { return _dropped.load(std::memory_order_relaxed); }
+
+    // times a sender waited for room in the queue
+    uint64_t waited() const         { return _waited.load(std::memory_order_relaxed); }
+
+    uint64_t written_bytes() const  { return _written_bytes.load(std::memory_order_relaxed); }
+
+private:
+    report_writer() : _mask(0), _tail(0), _fd(STDOUT_FILENO), _policy(overflow::block),
+        _running(false), _stopping(false), _senders(0), _sleeping(false), _waiting(0),
+        _written(0), _dropped(0), _waited(0), _written_bytes(0)
+    {
+    }
+
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        message msg;
+    };
+
+    // messages written with a single writev()
+    static const int max_batch = 64;
+
+    bool enqueue(message& msg)
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            cell& c = _cells[pos & _mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+            if(diff == 0)
+            {
+                if(_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.msg = std::move(msg);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    wake();
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                // the queue is full; stop() waits for the senders,
+                // so the writer keeps emptying it meanwhile
+                if(_policy == overflow::drop)
+                {
+                    _dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+
+                _waited.fetch_add(1, std::memory_order_relaxed);
+
+                wait_progress([this]() {
+                    size_t head = _head.load(std::memory_order_relaxed);
+                    return _cells[head & _mask].seq.load(std::memory_order_acquire) >= head;
+                });
+
+                pos = _head.load(std::memory_order_relaxed);
+            }
+            else
+            {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // waits until the writer has written enough; it notifies the waiting
+    // threads after each batch, the timeout covers a notification missed
+    // just before a thread started to wait
+    template<typename F>
+    void wait_progress(F done)
+    {
+        std::unique_lock<std::mutex> lock(_progress_lock);
+        _waiting.fetch_add(1, std::memory_order_seq_cst);
+
+        while(!done())
+        {
+            wake();
+            _progress.wait_for(lock, std::chrono::milliseconds(10));
+        }
+
+        _waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify_progress()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if(_waiting.load(std::memory_order_relaxed) != 0)
+        {
+            std::lock_guard<std::mutex> lock(_progress_lock);
+            _progress.notify_all();
+        }
+    }
+
+    // takes the next message, if there is one; only the writer thread consumes
+    bool receive(message& msg)
+    {
+        cell& c = _cells[_tail & _mask];
+
+        if(c.seq.load(std::memory_order_acquire) != _tail + 1)
+            return false;
+
+        msg = std::move(c.msg);
+        c.msg = nullptr;
+        c.seq.store(_tail + _mask + 1, std::memory_order_release);
+        ++_tail;
+        return true;
+    }
+
+    void run()
+    {
+        std::vector<std::string> texts(max_batch);
+        message msg;
+
+        while(true)
+        {
+            int count = 0;
+
+            for(; count < max_batch && receive(msg); ++count)
+            {
+                std::ostringstream out;
+                msg(out);
+                texts[count] = out.str();
+            }
+
+            if(count > 0)
+            {
+                write_batch(texts, count);
+                _written.fetch_add(count, std::memory_order_release);
+                notify_progress();
+                continue;
+            }
+
+            if(_stopping.load(std::memory_order_acquire))
+                break;
+
+            // senders wake the thread up only when it sleeps, the timeout
+            // covers a message sent just before the flag was set
+            std::unique_lock<std::mutex> lock(_sleep_lock);
+            _sleeping.store(true, std::memory_order_seq_cst);
+
+            if(_cells[_tail & _mask].seq.load(std::memory_order_acquire) != _tail + 1)
+                _wake_up.wait_for(lock, std::chrono::milliseconds(10));
+
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void write_batch(std::vector<std::string>& texts, int count)
+    {
+        struct iovec iov[max_batch];
+        int first = 0;
+
+        for(int i = 0; i < count; ++i)
+        {
+            iov[i].iov_base = &texts[i][0];
+            iov[i].iov_len = texts[i].size();
+        }
+
+        while(first < count)
+        {
+            ssize_t len = writev(_fd, iov + first, count - first);
+
+            if(len < 0 && errno == EINTR)
+                continue;
+
+            if(len < 0)
+                break;
+
+            _written_bytes.fetch_add(len, std::memory_order_relaxed);
+
+            // skip the written buffers, the last one might be written partially
+            for(; first < count && size_t(len) >= iov[first].iov_len; ++first)
+                len -= iov[first].iov_len;
+
+            if(first < count)
+            {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + len;
+                iov[first].iov_len -= len;
+            }
+        }
+    }
+
+    void wake()
+    {
+        if(_sleeping.load(std::memory_order_seq_cst))
+        {
+            std::lock_guard<std::mutex> lock(_sleep_lock);
+            _wake_up.notify_one();
+        }
+    }
+
+    std::unique_ptr<cell[]> _cells;
+    size_t _mask;
+    std::atomic<size_t> _head;      // next position to send to
+    size_t _tail;                   // next position to receive, used by the writer only
+
+    int _fd;
+    overflow _policy;
+    std::thread _thread;
+    std::atomic<bool> _running;
+    std::atomic<bool> _stopping;
+    std::atomic<int> _senders;      // threads in send()
+
+    std::mutex _sleep_lock;
+    std::condition_variable _wake_up;
+    std::atomic<bool> _sleeping;
+
+    // threads waiting for room in the queue or for a flush
+    std::mutex _progress_lock;
+    std::condition_variable _progress;
+    std::atomic<int> _waiting;
+
+    std::atomic<uint64_t> _written;     // messages
+    std::atomic<uint64_t> _dropped;
+    std::atomic<uint64_t> _waited;
+    std::atomic<uint64_t> _written_bytes;
+};
+
+// numbers of created and destroyed objects, split into cache line sized slots;
+// each thread updates its own slot, so the counters do not bounce between
+// cores, and the slots are summed up when read
+class object_counters
+{
+public:
+    object_counters()
+    {
+        for(slot& sl : _slots)
+        {
+            sl.created.store(0, std::memory_order_relaxed);
+            sl.destroyed.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // returns a number unique for each created object (never 0)
+    uint64_t add_created()
+    {
+        size_t idx = thread_slot();
+        uint64_t count = _slots[idx].created.fetch_add(1, std::memory_order_relaxed);
+        return count * slot_count + idx + 1;
+    }
+
+    void add_destroyed()
+    {
+        _slots[thread_slot()].destroyed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // withdraws a destruction counted by mistake
+    void remove_destroyed()
+    {
+        _slots[thread_slot()].destroyed.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    size_t created() const
+    {
+        size_t count = 0;
+
+        for(const slot& sl : _slots)
+            count += sl.created.load(std::memory_order_relaxed);
+
+        return count;
+    }
+
+    size_t destroyed() const
+    {
+        size_t count = 0;
+
+        for(const slot& sl : _slots)
+            count += sl.destroyed.load(std::memory_order_relaxed);
+
+        return count;
+    }
+
+private:
+    // threads get consecutive slots, more threads than slots share them
+    static const size_t slot_count = 64;
+
+    struct alignas(64) slot
+    {
+        std::atomic<size_t> created;
+        std::atomic<size_t> destroyed;
+    };
+
+    // the slot is assigned when the thread counts for the first time, a zero
+    // initialized thread_local does not need a guard on every access
+    static size_t thread_slot()
+    {
+        static std::atomic<size_t> next_slot(0);
+        static thread_local size_t slot_plus_one = 0;
+
+        if(slot_plus_one == 0)
+            slot_plus_one = next_slot.fetch_add(1, std::memory_order_relaxed) % slot_count + 1;
+
+        return slot_plus_one - 1;
+    }
+
+    slot _slots[slot_count];
+};
+
+// selects objects that have their stack traces captured
+enum class memcheck_sampling
+{
+    all,            // every object
+    every_nth,      // one of every N created objects
+    address_hash    // objects with address hash divisible by N, so the
+                    // same addresses are sampled every time
+};
+
+// selects where lifetime events are stored
+enum class memcheck_storage
+{
+    registry,       // directly in the sharded registry
+    event_log,      // appended to per-thread logs, merged into the
+                    // registry on queries or by a background thread
+    stream          // only written to the event stream, nothing is kept
+};
+
+// identifies an incarnation of an object, so a stale pointer to a destroyed
+// object is not mistaken for a new object created at the same address
+template<typename T>
+struct memcheck_handle
+{
+    memcheck_handle() : obj(nullptr), generation(0)
+    {
+    }
+
+    memcheck_handle(const T* obj, uint64_t generation) : obj(obj), generation(generation)
+    {
+    }
+
+    explicit operator bool() const { return obj != nullptr; }
+
+    const T* obj;
+    uint64_t generation;    // unique for each created object
+};
+
+// limits the history of destroyed objects, records exceeding any
+// of the limits are evicted (oldest first); 0 means no limit
+struct memcheck_retention
+{
+    memcheck_retention() : per_address(1), max_age(0), max_bytes(0), rss_limit(0)
+    {
+    }
+
+    unsigned per_address;               // records kept for each address
+    std::chrono::milliseconds max_age;  // time since destruction
+    size_t max_bytes;                   // memory used by the records
+    size_t rss_limit;                   // process resident memory that
+                                        // triggers trimming the history
+};
+
+// an existing object as seen in a report or a snapshot
+template<typename T>
+struct memcheck_object
+{
+    const T* obj;
+    uint64_t generation;
+    trace_store::trace_id trace;    // construction stack trace
+    size_t size;
+};
+
+// objects created and destroyed between two snapshots at a construction site
+struct memcheck_site_diff
+{
+    trace_store::trace_id trace;
+    size_t added;
+    size_t removed;
+    size_t added_bytes;
+    size_t removed_bytes;
+};
+
+// immutable set of existing objects, sorted by address and generation,
+// so two snapshots are compared by merging them; copies share the objects
+template<typename T>
+class memcheck_snapshot
+{
+public:
+    typedef memcheck_object<T> object;
+
+    memcheck_snapshot() : _objs(std::make_shared<std::vector<object>>())
+    {
+    }
+
+    explicit memcheck_snapshot(std::vector<object>&& objs)
+    {
+        std::sort(objs.begin(), objs.end(), before);
+        _objs = std::make_shared<std::vector<object>>(std::move(objs));
+    }
+
+    size_t size() const                 { return _objs->size(); }
+    const object* begin() const         { return _objs->data(); }
+    const object* end() const           { return _objs->data() + _objs->size(); }
+
+    size_t bytes() const
+    {
+        size_t sum = 0;
+
+        for(const object& obj : *_objs)
+            sum += obj.size;
+
+        return sum;
+    }
+
+    // objects created and destroyed between snapshots a and b, grouped
+    // by construction site, the fastest growing sites first
+    static std::vector<memcheck_site_diff> diff(const memcheck_snapshot& a,
+            const memcheck_snapshot& b)
+    {
+        flat_table<trace_store::trace_id, size_t> site_idx;
+        std::vector<memcheck_site_diff> sites;
+
+        auto site_of = [&](const object& obj) -> memcheck_site_diff& {
+            auto it = site_idx.find(obj.trace);
+
+            if(it != site_idx.end())
+                return sites[it->second];
+
+            site_idx[obj.trace] = sites.size();
+            memcheck_site_diff site = { obj.trace, 0, 0, 0, 0 };
+            sites.push_back(site);
+            return sites.back();
+        };
+
+        // an object at a reused address has a different generation,
+        // so it counts as removed and added
+        const object* it_a = a.begin();
+        const object* it_b = b.begin();
+
+        while(it_a != a.end() || it_b != b.end())
+        {
+            if(it_b == b.end() || (it_a != a.end() && before(*it_a, *it_b)))
+            {
+                memcheck_site_diff& site = site_of(*it_a);
+                ++site.removed;
+                site.removed_bytes += it_a->size;
+                ++it_a;
+            }
+            else if(it_a == a.end() || before(*it_b, *it_a))
+            {
+                memcheck_site_diff& site = site_of(*it_b);
+                ++site.added;
+                site.added_bytes += it_b->size;
+                ++it_b;
+            }
+            else
+            {
+                ++it_a;
+                ++it_b;
+            }
+        }
+
+        std::sort(sites.begin(), sites.end(),
+                [](const memcheck_site_diff& x, const memcheck_site_diff& y) {
+                    return int64_t(x.added_bytes - x.removed_bytes)
+                        > int64_t(y.added_bytes - y.removed_bytes);
+                });
+
+        return sites;
+    }
+
+private:
+    static bool before(const object& a, const object& b)
+    {
+        return a.obj != b.obj ? a.obj < b.obj : a.generation < b.generation;
+    }
+
+    std::shared_ptr<const std::vector<object>> _objs;
+};
+
+// what memcheck<T> records about the tracked objects
+enum class memcheck_mode
+{
+    disabled,       // the hooks do nothing and compile to nothing
+    count_only,     // created and destroyed objects are only counted
+    create_trace,   // existing objects are registered with their construction stack traces
+    full            // destruction stack traces are stored as well
+};
+
+// a lock that does not lock, for types used by a single thread
+struct null_lock
+{
+    void lock() {}
+    void unlock() {}
+};
+
+// turns tracking of a type on and off at run time; the switches of all
+// tracked types are kept in a fixed table, so a signal handler can flip them
+struct memcheck_switch
+{
+    void set(bool on)
+    {
+        if(!on)
+            missed.store(true, std::memory_order_relaxed);
+
+        enabled.store(on, std::memory_order_relaxed);
+    }
+
+    std::atomic<bool> enabled;
+    std::atomic<bool> missed;   // objects might have been created while it was off
+
+    // makes the switch available to set_all() and the signal handler
+    static void add(memcheck_switch* sw)
+    {
+        int idx = count().fetch_add(1);
+
+        if(idx < max_switches)
+            switches()[idx].store(sw);
+    }
+
+    static void set_all(bool on)
+    {
+        for(int i = 0; i < size(); ++i)
+        {
+            if(memcheck_switch* sw = switches()[i].load())
+                sw->set(on);
+        }
+    }
+
+    // flips all switches whenever signo is received
+    static void toggle_on_signal(int signo)
+    {
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = toggle_all;
+        act.sa_flags = SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        sigaction(signo, &act, nullptr);
+    }
+
+private:
+    static const int max_switches = 256;
+
+    // atomics of the table are async-signal-safe, the table is zero-initialized
+    static std::atomic<memcheck_switch*>* switches()
+    {
+        static std::atomic<memcheck_switch*> table[max_switches];
+        return table;
+    }
+
+    static std::atomic<int>& count()
+    {
+        static std::atomic<int> num;
+        return num;
+    }
+
+    static int size()
+    {
+        int num = count().load();
+        return num < max_switches ? num : max_switches;
+    }
+
+    static void toggle_all(int)
+    {
+        for(int i = 0; i < size(); ++i)
+        {
+            if(memcheck_switch* sw = switches()[i].load())
+                sw->set(!sw->enabled.load(std::memory_order_relaxed));
+        }
+    }
+};
+
+// tracking policy selected at compile time; specialize memcheck_traits<T>
+// deriving from memcheck_default_traits to change only some of the fields
+struct memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::full;
+    static const int depth = call_stack::depth;     // captured stack frames
+    static const memcheck_storage storage = memcheck_storage::registry;    // initial one
+    static const bool enabled = true;               // initial state of the run time switch
+    static const bool heap_allocated = false;       // object sizes are read with
+                                                    // malloc_usable_size() instead of sizeof()
+    typedef std::mutex lock_type;                   // guards the registry shards
+};
+
+template<typename T>
+struct memcheck_traits : memcheck_default_traits
+{
+};
+
+template<typename T, typename Policy = memcheck_traits<T>,
+        bool enabled = Policy::mode != memcheck_mode::disabled>
+class memcheck;
+
+// tracks objects as selected by the policy
+template<typename T, typename Policy>
+class memcheck<T, Policy, true>
+{
+private:
+    // an entry storing the construction stack trace of an existing object,
+    // destroyed objects are moved to the history
+    struct obj_info
+    {
+        obj_info() : create_trace(trace_store::no_trace), generation(0), size(0)
+        {
+        }
+
+        trace_store::trace_id create_trace;
+        uint64_t generation;
+        size_t size;
+    };
+
+    // there is a single instance per type, returned by get(); per-thread
+    // event logs are attached to it
+    memcheck()
+        : _sampling(sampling::all), _sample_rate(1), _sample_counter(0),
+        _copied(0), _moved(0), _history_added(0), _stream(nullptr), _stream_type(0),
+        _mapped(nullptr), _mapped_type(0), _storage(Policy::storage), _merge_count(0),
+        _merger_running(false)
+    {
+        _switch.enabled = Policy::enabled;
+        _switch.missed = !Policy::enabled;
+        memcheck_switch::add(&_switch);
+        configure(getenv("MEMCHECK"));
+    }
+
+public:
+    typedef memcheck_sampling sampling;
+    typedef memcheck_storage storage;
+    typedef memcheck_handle<T> handle;
+    typedef memcheck_retention retention;
+    typedef typename Policy::lock_type lock_type;
+
+    static memcheck& get()
+    {
+        // it has to be created on the heap so it is not destroyed at the
+        // end, as you may want to check whether everything was deleted
+        // if memcheck is the only leak, then you write good software
+        // (initialization of local statics is thread-safe)
+        static memcheck* inst = new memcheck();
+
+        return *inst;
+    }
+
+    // preallocate the registry for n objects, so it does not rehash while
+    // the tracked objects are being created
+    void reserve(size_t n)
+    {
+        for(shard& sh : _shards)
+        {
+            std::lock_guard<lock_type> lock(sh.lock);
+            // pointers are not spread perfectly evenly
+            sh.entries.reserve(n / shard_count + n / shard_count / 4 + 1);
+        }
+    }
+
+    // captures stack traces only for a sample of objects (1 in rate), the
+    // remaining ones are just counted; reports scale the sampled numbers.
+    // It may be changed while objects are tracked, then the hooks may see
+    // the new rate with the old mode for a moment, which is still a sampling.
+    void set_sampling(sampling mode, unsigned rate)
+    {
+        assert(rate > 0);
+        _sampling.store(rate > 1 ? mode : sampling::all, std::memory_order_relaxed);
+        _sample_rate.store(rate, std::memory_order_relaxed);
+    }
+
+    // number of objects created, destroyed and alive, including not sampled ones
+    size_t created_count() const    { return _counters.created(); }
+    size_t destroyed_count() const  { return _counters.destroyed(); }
+    // objects created while tracking was off are not known in count_only mode
+    // or when they are sampled, so their destructions are counted; the count
+    // is kept from wrapping around then
+    size_t live_count() const
+    {
+        size_t destroyed = destroyed_count();
+        size_t created = created_count();
+        return created > destroyed ? created - destroyed : 0;
+    }
+
+    // number of copies and moves (both construction and assignment),
+    // counted for types derived from tracked<T>
+    size_t copy_count() const       { return _copied.load(std::memory_order_relaxed); }
+    size_t move_count() const       { return _moved.load(std::memory_order_relaxed); }
+
+    void copied()
+    {
+        if(_switch.enabled.load(std::memory_order_relaxed))
+            _copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void moved()
+    {
+        if(_switch.enabled.load(std::memory_order_relaxed))
+            _moved.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // number of objects stored in the registry, sampled ones only
+    size_t registered_count() const
+    {
+        size_t count = 0;
+        sync();
+
+        for(const shard& sh : _shards)
+        {
+            std::lock_guard<lock_type> lock(sh.lock);
+            count += sh.entries.size();
+        }
+
+        return count;
+    }
+
+    // number of destroyed objects kept in the history
+    size_t history_size() const
+    {
+        size_t count = 0;
+        sync();
+
+        for(const shard& sh : _shards)
+        {
+            std::lock_guard<lock_type> lock(sh.lock);
+            count += sh.history.size() - sh.history_dead;
+        }
+
+        return count;
+    }
+
+    // turns tracking on and off; objects created while it was off are ignored
+    void enable(bool on)
+    {
+        _switch.set(on);
+    }
+
+    bool enabled() const
+    {
+        return _switch.enabled.load(std::memory_order_relaxed);
+    }
+
+    // an object that could not be registered, e.g. as there was no memory
+    // for its entry; its destruction is then ignored, as the ones of objects
+    // created while tracking was off
+    void missed()
+    {
+        _switch.missed.store(true, std::memory_order_relaxed);
+    }
+
+    // applies settings from a string like the MEMCHECK environment variable:
+    // comma separated type names with colon separated options, e.g.
+    // "foo:sample=100,bar:off"; '*' matches any type. Options:
+    //   on, off        enables or disables tracking
+    //   sample=N       tracks every N-th object
+    //   sample_addr=N  tracks objects with address hash divisible by N
+    //   log            stores events in per-thread logs
+    //   leaks          shows the leak report at exit (see show_leaks())
+    void configure(const char* spec)
+    {
+        if(!spec)
+            return;
+
+        std::string type = type_name();
+        std::istringstream entries(spec);
+        std::string entry;
+
+        while(std::getline(entries, entry, ','))
+        {
+            std::istringstream fields(entry);
+            std::string name, option;
+            std::getline(fields, name, ':');
+
+            if(name != type && name != "*")
+                continue;
+
+            enable(true);
+
+            while(std::getline(fields, option, ':'))
+            {
+                size_t eq = option.find('=');
+                std::string key = option.substr(0, eq);
+                unsigned value = eq != std::string::npos
+                    ? strtoul(option.c_str() + eq + 1, nullptr, 10) : 0;
+
+                if(key == "on")
+                    enable(true);
+                else if(key == "off")
+                    enable(false);
+                else if(key == "sample" && value > 0)
+                    set_sampling(sampling::every_nth, value);
+                else if(key == "sample_addr" && value > 0)
+                    set_sampling(sampling::address_hash, value);
+                else if(key == "log")
+                    set_storage(storage::event_log);
+                else if(key == "leaks")
+                    show_leaks_at_exit();
+                else
+                    std::cerr << "memcheck: unknown option " << option << std::endl;
+            }
+        }
+    }
+
+    // writes lifetime events of the tracked objects to a stream (nullptr stops
+    // it), has to be set before any object is created; the stream has to
+    // exist as long as the objects are tracked
+    void set_stream(event_stream* stream)
+    {
+        if(stream)
+            _stream_type = stream->add_type(type_name());
+
+        _stream = stream;
+    }
+
+    // keeps existing objects also in a memory-mapped file, so they can be
+    // examined after a crash (nullptr stops it); has to be set before any
+    // object is created, the registry has to exist as long as the objects
+    // are tracked
+    void set_mapped_registry(mapped_registry* registry)
+    {
+        if(registry)
+            _mapped_type = registry->add_type(type_name());
+
+        _mapped = registry;
+    }
+
+    // has to be selected before any object is created
+    void set_retention(const retention& policy)
+    {
+        _retention = policy;
+    }
+
+    // has to be selected before any object is created
+    void set_storage(storage mode)
+    {
+        _storage = mode;
+    }
+
+    // starts a thread merging the per-thread logs periodically,
+    // so they are not merged by the threads that query the registry
+    void start_merger(std::chrono::milliseconds period)
+    {
+        stop_merger();
+        _merger_running = true;
+        _merger = std::thread([this, period]() {
+            std::unique_lock<std::mutex> lock(_merger_lock);
+
+            while(!_merger_stop.wait_for(lock, period, [this]() { return !_merger_running; }))
+                merge_logs();
+        });
+    }
+
+    void stop_merger()
+    {
+        if(!_merger.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(_merger_lock);
+            _merger_running = false;
+        }
+
+        _merger_stop.notify_all();
+        _merger.join();
+    }
+
+    // returns a handle to check whether this particular object still exists,
+    // which works only for sampled objects; size is the memory taken by
+    // the object, by default sizeof(T) or the size of its heap block
+    __attribute__((noinline))
+    handle created(const T* obj, size_t size = 0)
+    {
+        assert(obj);
+
+        if(!obj || !_switch.enabled.load(std::memory_order_relaxed))
+            return handle();
+
+        // the counter gives each object its generation for free
+        uint64_t generation = _counters.add_created();
+
+        if(Policy::mode == memcheck_mode::count_only || !sampled(obj))
+            return handle(obj, generation);
+
+        // capture the stack trace before locking, it is the slow part
+        trace_store::trace_id trace = trace_store::get().capture(Policy::depth);
+
+        if(size == 0)
+            size = Policy::heap_allocated ? malloc_usable_size(const_cast<T*>(obj)) : sizeof(T);
+
+        return add_object(obj, trace, generation, size);
+    }
+
+    __attribute__((noinline))
+    bool destroyed(const T* obj)
+    {
+        assert(obj);
+
+        if(!obj)
+            return false;
+
+        if(!_switch.enabled.load(std::memory_order_relaxed))
+            return true;
+
+        if(Policy::mode == memcheck_mode::count_only)
+        {
+            _counters.add_destroyed();
+            return true;
+        }
+
+        if(_storage != storage::registry)
+        {
+            _counters.add_destroyed();
+
+            // the registry is not consulted on the hot path, so objects sampled
+            // one in N are logged anyway and ignored when merged (or analyzed)
+            if(_sampling.load(std::memory_order_relaxed) == sampling::address_hash && !sampled(obj))
+                return true;
+
+            trace_store::trace_id trace = destroy_trace();
+
+            if(_stream)
+                _stream->write_event(_stream_type, false, obj, trace, 0);
+
+            if(_mapped)
+                _mapped->destroyed(_mapped_type, obj);
+
+            if(_storage == storage::event_log)
+                log_event(obj, trace, 0, 0);
+
+            return true;
+        }
+
+        // the registry is searched once; objects that are not there were either
+        // not sampled or created while tracking was off
+        trace_store::trace_id trace = trace_store::no_trace;
+        bool registered = register_destroyed(obj, [&trace]() {
+            return trace = destroy_trace();
+        });
+
+        // destruction of objects created while tracking was off is ignored;
+        // it is detected only if all objects are registered, otherwise
+        // the counters are skewed by those objects
+        assert(registered || _switch.missed.load(std::memory_order_relaxed)
+                || _sampling.load(std::memory_order_relaxed) != sampling::all);
+
+        if(registered || _sampling.load(std::memory_order_relaxed) != sampling::all)
+            _counters.add_destroyed();
+
+        if(!registered)
+            return true;
+
+        if(_stream)
+            _stream->write_event(_stream_type, false, obj, trace, 0);
+
+        if(_mapped)
+            _mapped->destroyed(_mapped_type, obj);
+
+        return true;
+    }
+
+    // unregisters an object that is about to be destroyed and returns the stack
+    // trace and size it was registered with, so it can be restored() if it
+    // survives after all (e.g. a heap block passed to a failing realloc());
+    // returns false if the object is not registered
+    bool released(const T* obj, trace_store::trace_id& trace, size_t& size)
+    {
+        if(!obj || !_switch.enabled.load(std::memory_order_relaxed)
+                || Policy::mode == memcheck_mode::count_only || _storage != storage::registry)
+            return false;
+
+        trace_store::trace_id destroy = trace_store::no_trace;
+        obj_info info;
+
+        bool registered = register_destroyed(obj, [&destroy]() {
+            return destroy = destroy_trace();
+        }, &info);
+
+        if(!registered)
+            return false;
+
+        _counters.add_destroyed();
+
+        if(_stream)
+            _stream->write_event(_stream_type, false, obj, destroy, 0);
+
+        if(_mapped)
+            _mapped->destroyed(_mapped_type, obj);
+
+        trace = info.create_trace;
+        size = info.size;
+        return true;
+    }
+
+    // registers again an object unregistered by released()
+    handle restored(const T* obj, trace_store::trace_id trace, size_t size)
+    {
+        if(!obj || !_switch.enabled.load(std::memory_order_relaxed))
+            return handle();
+
+        return add_object(obj, trace, _counters.add_created(), size);
+    }
+
+    // folds the per-thread logs into the registry; queries do it automatically
+    __attribute__((noinline))
+    void merge_logs()
+    {
+        std::lock_guard<std::mutex> lock(_logs_lock);
+        std::vector<event> events;
+        events.swap(_pending);
+
+        // events of each thread (and the pending ones) are ordered, but
+        // have to be interleaved with the other threads' ones
+        auto earlier = [](const event& a, const event& b) { return a.time < b.time; };
+
+        for(event_ring* ring : _rings)
+        {
+            size_t sorted = events.size();
+            ring->drain(events);
+            std::inplace_merge(events.begin(), events.begin() + sorted, events.end(), earlier);
+        }
+
+        ++_merge_count;
+
+        for(const event& ev : events)
+        {
+            bool applied = ev.generation
+                ? register_created(ev.obj, ev.trace, ev.generation, ev.size)
+                : register_destroyed(ev.obj, [&ev]() { return ev.trace; });
+
+            // an event might have arrived before the one preceding it in
+            // another thread log (e.g. construction in a thread that was not
+            // drained yet), it is retried during the next merge. Events that
+            // still do not fit are destructions of objects that were not
+            // sampled, or objects created before the logs were enabled.
+            if(!applied && ev.merge == 0)
+            {
+                _pending.push_back(ev);
+                _pending.back().merge = _merge_count;
+            }
+            else if(!applied && ev.generation)
+            {
+                // the previous incarnation has been destroyed for sure
+                register_destroyed(ev.obj, []() { return trace_store::no_trace; });
+                register_created(ev.obj, ev.trace, ev.generation, ev.size);
+            }
+            else if(!applied && _sampling.load(std::memory_order_relaxed) == sampling::all)
+            {
+                // all objects are registered, so it was created while
+                // tracking was off and its destruction does not count
+                _counters.remove_destroyed();
+            }
+        }
+    }
+
+    __attribute__((noinline))
+    bool exists(const T* obj) const
+    {
+        sync();
+        const shard& sh = shard_for(obj);
+        std::lock_guard<lock_type> lock(sh.lock);
+
+        // destroyed objects are not stored in the entries
+        return sh.entries.find(obj) != sh.entries.end();
+    }
+
+    // checks whether the object the handle was created for still exists,
+    // even if another object has been created at the same address since then
+    __attribute__((noinline))
+    bool exists(const handle& h) const
+    {
+        sync();
+        const shard& sh = shard_for(h.obj);
+        std::lock_guard<lock_type> lock(sh.lock);
+        auto it = sh.entries.find(h.obj);
+
+        return it != sh.entries.end() && it->second.generation == h.generation;
+    }
+
+    __attribute__((noinline))
+    void show_create(const T* obj) const
+    {
+        assert(obj);
+        trace_store::trace_id st = find(obj).create_trace;
+
+        if(st)
+        {
+            report([obj, st](std::ostream& out) {
+                out << "construction stack trace for " << obj << std::endl;
+                out << trace_store::get().stack(st).as_string();
+            });
+            return;
+        }
+
+        bool missed = _switch.missed.load(std::memory_order_relaxed);
+
+        report([obj, missed](std::ostream& out) {
+            if(missed)
+                out << obj << " has not been created while tracking was enabled" << std::endl;
+            else
+                out << obj << " has not been created" << std::endl;
+        }, std::cerr);
+    }
+
+    __attribute__((noinline))
+    void show_destroy(const T* obj) const
+    {
+        assert(obj);
+        history_record rec;
+
+        if(!exists(obj) && find_destroyed(obj, rec))
+        {
+            trace_store::trace_id st = rec.destroy_trace;
+
+            report([obj, st](std::ostream& out) {
+                out << "destruction stack trace for " << obj << std::endl;
+
+                if(st)
+                    out << trace_store::get().stack(st).as_string();
+            });
+            return;
+        }
+
+        report([obj](std::ostream& out) {
+            out << obj << " has not been destroyed" << std::endl;
+        }, std::cerr);
+    }
+
+    __attribute__((noinline))
+    void show_objs(bool show_stack = false) const
+    {
+        // the objects and counters are read now, the report is written later
+        std::vector<live_object> objs = live_objects();
+        sampling mode = _sampling.load(std::memory_order_relaxed);
+        unsigned rate = _sample_rate.load(std::memory_order_relaxed);
+        size_t counted = live_count(), copies = copy_count(), moves = move_count();
+
+        report([=](std::ostream& out) {
+            out << "existing objects:" << std::endl;
+
+            for(const auto& obj : objs)
+            {
+                out << obj.obj << " (" << std::dec << obj.size << " bytes)" << std::endl;
+
+                if(show_stack)
+                {
+                    out << "construction stack trace for " << obj.obj << std::endl;
+                    out << trace_store::get().stack(obj.trace).as_string();
+                }
+            }
+
+            if(mode != sampling::all)
+            {
+                out << "sampled " << objs.size() << " objects (1 in " << rate
+                    << "), estimated " << objs.size() * rate
+                    << ", counted " << counted << std::endl;
+            }
+
+            if(copies || moves)
+                out << "copied " << copies << " times, moved " << moves << " times" << std::endl;
+        });
+    }
+
+    typedef memcheck_snapshot<T> snapshot_type;
+
+    // captures the set of existing objects, to be compared with diff()
+    snapshot_type snapshot() const
+    {
+        return snapshot_type(collect_objects());
+    }
+
+    static std::vector<memcheck_site_diff> diff(const snapshot_type& a, const snapshot_type& b)
+    {
+        return snapshot_type::diff(a, b);
+    }
+
+    // shows construction sites of objects created or destroyed between the snapshots
+    __attribute__((noinline))
+    void show_diff(const snapshot_type& a, const snapshot_type& b) const
+    {
+        // snapshots are immutable, so they are compared by the writer
+        report([a, b](std::ostream& out) {
+            out << "changes since the snapshot (" << std::dec << a.size() << " objects, "
+                << a.bytes() << " bytes):" << std::endl;
+
+            for(const memcheck_site_diff& site : diff(a, b))
+            {
+                out << "+" << site.added << " -" << site.removed << " objects, +"
+                    << site.added_bytes << " -" << site.removed_bytes
+                    << " bytes created at" << std::endl;
+                out << trace_store::get().stack(site.trace).as_string();
+            }
+        });
+    }
+
+    // memory taken by the existing (sampled) objects
+    size_t live_bytes() const
+    {
+        size_t bytes = 0;
+
+        for(const auto& obj : collect_objects())
+            bytes += obj.size;
+
+        return bytes;
+    }
+
+    // shows places where the existing objects were created,
+    // the ones holding the most memory first
+    __attribute__((noinline))
+    void show_sites() const
+    {
+        std::vector<live_object> objs = live_objects();
+        sampling mode = _sampling.load(std::memory_order_relaxed);
+        unsigned rate = _sample_rate.load(std::memory_order_relaxed);
+
+        report([objs, mode, rate](std::ostream& out) {
+            out << "creation sites:" << std::endl;
+            write_sites(out, objs, 0, mode, rate);
+        });
+    }
+
+    // shows the existing objects grouped by their creation sites, the ones
+    // holding the most memory first, with a few example addresses of each
+    __attribute__((noinline))
+    void show_leaks(size_t examples = 3) const
+    {
+        // no need to sort the objects, only the sites are sorted
+        std::vector<live_object> objs = collect_objects();
+        sampling mode = _sampling.load(std::memory_order_relaxed);
+        unsigned rate = _sample_rate.load(std::memory_order_relaxed);
+
+        report([objs, examples, mode, rate](std::ostream& out) {
+            size_t bytes = 0;
+
+            for(const auto& obj : objs)
+                bytes += obj.size;
+
+            out << "leaks of " << type_name() << ": " << std::dec << objs.size()
+                << " objects, " << bytes << " bytes" << std::endl;
+            write_sites(out, objs, examples, mode, rate);
+        });
+    }
+
+    // shows the leak report when the process exits
+    void show_leaks_at_exit()
+    {
+        static bool registered = (atexit([]() { get().show_leaks(); }) == 0);
+        (void) registered;
+    }
+
+    // writes existing objects with their construction stack traces stored as
+    // module offsets; no symbols are resolved, memcheck-symbolize turns
+    // the report into readable stack traces offline
+    __attribute__((noinline))
+    void dump(std::ostream& out) const
+    {
+        module_table& modules = module_table::get();
+        flat_table<trace_store::trace_id, bool> dumped;
+        std::ostringstream traces, objs;
+
+        for(const auto& obj : live_objects())
+        {
+            trace_store::trace_id id = obj.trace;
+
+            objs << "object " << obj.obj << " " << std::dec << id << " " << obj.size << "\n";
+
+            if(dumped[id])
+                continue;
+
+            call_stack st = trace_store::get().stack(id);
+            dumped[id] = true;
+            traces << "trace " << std::dec << id;
+
+            for(int i = 0; i < st.size(); ++i)
+            {
+                int mod = modules.find(st.frames()[i]);
+                uintptr_t addr = reinterpret_cast<uintptr_t>(st.frames()[i]);
+
+                traces << " " << std::dec << mod << ":" << std::hex
+                       << addr - (mod >= 0 ? modules[mod].base : 0);
+            }
+
+            traces << "\n";
+        }
+
+        out << "memcheck 1\n";
+        out << "type " << type_name() << "\n";
+
+        for(size_t i = 0; i < modules.size(); ++i)
+        {
+            const module_table::module& mod = modules[i];
+            out << "module " << std::dec << i << " " << std::hex << mod.base << " "
+                << (mod.build_id.empty() ? "-" : mod.build_id) << " " << mod.path << "\n";
+        }
+
+        out << traces.str() << objs.str();
+        out.flush();
+    }
+
+private:
+    // the registry is split into shards selected by object address,
+    // each one with its own lock, so threads do not contend for a single one
+    static const int shard_count = 64;
+
+    // a destroyed object; records are identified by sequence numbers
+    // growing in each shard, so they stay valid when the oldest are evicted
+    struct history_record
+    {
+        const T* obj;
+        trace_store::trace_id create_trace;
+        trace_store::trace_id destroy_trace;
+        uint64_t time;          // destruction time, only when the age is limited
+        uint64_t next;          // next record of the same address, 0 if none
+        bool alive;             // false if evicted, but not removed from the queue yet
+    };
+
+    // the oldest and the latest alive history records of an address
+    struct addr_history
+    {
+        addr_history() : oldest(0), latest(0), count(0)
+        {
+        }
+
+        uint64_t oldest;
+        uint64_t latest;
+        unsigned count;         // alive records
+    };
+
+    // memory used by a history record: the record, a slot in by_addr for its
+    // address (a table grown twice is half empty) and its share of the deque map
+    static const size_t history_record_bytes = sizeof(history_record)
+        + 2 * (sizeof(typename flat_table<const T*, addr_history>::slot) + 1)
+        + (sizeof(void*) * sizeof(history_record) + 511) / 512;
+
+    struct alignas(64) shard
+    {
+        shard() : history_first(1), history_dead(0)
+        {
+        }
+
+        history_record& record(uint64_t seq)
+        {
+            return history[seq - history_first];
+        }
+
+        mutable lock_type lock;
+        flat_table<const T*, obj_info> entries;
+
+        // records of destroyed objects, ordered by destruction
+        std::deque<history_record> history;
+        uint64_t history_first;     // sequence number of the front record
+        size_t history_dead;        // evicted records still in the queue
+        flat_table<const T*, addr_history> by_addr;
+    };
+
+    shard& shard_for(const T* obj)
+    {
+        return _shards[shard_index(obj)];
+    }
+
+    const shard& shard_for(const T* obj) const
+    {
+        return _shards[shard_index(obj)];
+    }
+
+    static size_t shard_index(const T* obj)
+    {
+        // objects are aligned, so the lowest bits are not used
+        uint64_t h = reinterpret_cast<uintptr_t>(obj) * 0x9e3779b97f4a7c15ULL;
+        return (h >> 40) % shard_count;
+    }
+
+    // returns a copy of the object entry, or an empty one if it is not registered
+    obj_info find(const T* obj) const
+    {
+        sync();
+        const shard& sh = shard_for(obj);
+        std::lock_guard<lock_type> lock(sh.lock);
+        auto it = sh.entries.find(obj);
+
+        return it != sh.entries.end() ? it->second : obj_info();
+    }
+
+    typedef memcheck_object<T> live_object;
+
+    // collects existing objects with their construction stack traces, so
+    // they can be reported without holding the locks
+    std::vector<live_object> collect_objects() const
+    {
+        std::vector<live_object> objs;
+        sync();
+
+        for(const shard& sh : _shards)
+        {
+            std::lock_guard<lock_type> lock(sh.lock);
+
+            // memory owned by the objects changes during their lifetime, so it
+            // is checked now; the lock keeps the objects from being destroyed
+            // (unregistered) in the meantime
+            for(const auto& info : sh.entries)
+            {
+                live_object obj = { info.first, info.second.generation,
+                        info.second.create_trace,
+                        info.second.size + owned_size(*info.first, 0) };
+                objs.push_back(obj);
+            }
+        }
+
+        return objs;
+    }
+
+    // existing objects, the biggest ones first
+    std::vector<live_object> live_objects() const
+    {
+        std::vector<live_object> objs = collect_objects();
+
+        std::stable_sort(objs.begin(), objs.end(),
+                [](const live_object& a, const live_object& b) { return a.size > b.size; });
+
+        return objs;
+    }
+
+    // writes places where the objects were created, the ones holding
+    // the most memory first, each with up to the given number of objects
+    static void write_sites(std::ostream& out, const std::vector<live_object>& objs,
+            size_t examples, sampling mode, unsigned rate)
+    {
+        struct site
+        {
+            trace_store::trace_id trace;
+            size_t count;
+            size_t bytes;
+            std::vector<const T*> examples;
+        };
+
+        // sites are looked up once per object
+        flat_table<trace_store::trace_id, size_t> site_idx;
+        std::vector<site> sites;
+
+        for(const auto& obj : objs)
+        {
+            size_t& idx = site_idx[obj.trace];
+
+            // indices are stored incremented, 0 is a new site
+            if(idx == 0)
+            {
+                sites.push_back(site { obj.trace, 0, 0, {} });
+                idx = sites.size();
+            }
+
+            site& s = sites[idx - 1];
+            ++s.count;
+            s.bytes += obj.size;
+
+            if(s.examples.size() < examples)
+                s.examples.push_back(obj.obj);
+        }
+
+        std::sort(sites.begin(), sites.end(),
+                [](const site& a, const site& b) { return a.bytes > b.bytes; });
+
+        for(const site& s : sites)
+        {
+            out << std::dec << s.bytes << " bytes in " << s.count << " objects created at";
+
+            for(size_t i = 0; i < s.examples.size(); ++i)
+                out << (i == 0 ? " (e.g. " : ", ") << s.examples[i];
+
+            out << (s.examples.empty() ? "" : ")") << std::endl;
+            out << trace_store::get().stack(s.trace).as_string();
+        }
+
+        if(mode != sampling::all)
+            out << "sampled 1 in " << rate << " objects" << std::endl;
+    }
+
+    // sends a report to the writer thread if it is running,
+    // otherwise writes it right away
+    static void report(report_writer::message msg, std::ostream& sync_out = std::cout)
+    {
+        report_writer& writer = report_writer::get();
+
+        // the writer may be stopped meanwhile, then the message is kept
+        if(!writer.send(std::move(msg)) && !writer.running())
+            msg(sync_out);
+    }
+
+    // memory owned by an object, as reported by memcheck_size(const T&)
+    // (found by argument-dependent lookup), if there is such function. It is
+    // called with the registry shard locked, so the object cannot be
+    // unregistered meanwhile; it must not use memcheck<T> itself. Classes
+    // derived from tracked<T> unregister their objects with untrack() before
+    // the members are destroyed.
+    template<typename U>
+    static auto owned_size(const U& obj, int) -> decltype(size_t(memcheck_size(obj)))
+    {
+        return memcheck_size(obj);
+    }
+
+    template<typename U>
+    static size_t owned_size(const U&, long)
+    {
+        return 0;
+    }
+
+    // registers a new object, returns false if it already exists
+    bool register_created(const T* obj, trace_store::trace_id trace, uint64_t generation,
+            size_t size)
+    {
+        shard& sh = shard_for(obj);
+        std::lock_guard<lock_type> lock(sh.lock);
+
+        if(sh.entries.find(obj) != sh.entries.end())
+            return false;
+
+        obj_info& info = sh.entries[obj];
+        info.create_trace = trace;
+        info.generation = generation;
+        info.size = size;
+        return true;
+    }
+
+    // stores a sampled object in the selected storage
+    handle add_object(const T* obj, trace_store::trace_id trace, uint64_t generation, size_t size)
+    {
+        if(_stream)
+            _stream->write_event(_stream_type, true, obj, trace, size);
+
+        if(_mapped)
+            _mapped->created(_mapped_type, obj, trace, size);
+
+        if(_storage == storage::stream)
+            return handle(obj, generation);
+
+        if(_storage == storage::event_log)
+        {
+            log_event(obj, trace, generation, size);
+            return handle(obj, generation);
+        }
+
+        bool registered = register_created(obj, trace, generation, size);
+        assert(registered);
+        (void) registered;
+        return handle(obj, generation);
+    }
+
+    // marks an existing object as destroyed, returns false if it does not exist;
+    // get_trace() gives the destruction stack trace, it is called only when
+    // the object is found, so the registry is searched once. The removed
+    // entry is copied to info, if given.
+    template<typename TraceSource>
+    bool register_destroyed(const T* obj, TraceSource get_trace, obj_info* info = nullptr)
+    {
+        {
+            shard& sh = shard_for(obj);
+            std::lock_guard<lock_type> lock(sh.lock);
+            auto it = sh.entries.find(obj);
+
+            if(it == sh.entries.end())
+                return false;
+
+            if(info)
+                *info = it->second;
+
+            add_history(sh, obj, it->second.create_trace, get_trace());
+            sh.entries.erase(obj);
+        }
+
+        // reading the resident memory size is too slow to do it every time
+        if(_retention.rss_limit
+                && _history_added.fetch_add(1, std::memory_order_relaxed) % rss_check_period == 0
+                && resident_memory() > _retention.rss_limit)
+            trim_history();
+
+        return true;
+    }
+
+    // finds the latest record of a destroyed object
+    bool find_destroyed(const T* obj, history_record& rec) const
+    {
+        sync();
+        const shard& sh = shard_for(obj);
+        std::lock_guard<lock_type> lock(sh.lock);
+        auto it = sh.by_addr.find(obj);
+
+        if(it == sh.by_addr.end())
+            return false;
+
+        rec = sh.history[it->second.latest - sh.history_first];
+        return true;
+    }
+
+    // appends a record to the history of a shard and evicts the ones exceeding
+    // the retention limits; sh has to be locked
+    void add_history(shard& sh, const T* obj, trace_store::trace_id create_trace,
+            trace_store::trace_id destroy_trace)
+    {
+        uint64_t now = _retention.max_age.count()
+            ? std::chrono::steady_clock::now().time_since_epoch().count() : 0;
+        addr_history& addr = sh.by_addr[obj];
+        uint64_t seq = sh.history_first + sh.history.size();
+
+        history_record rec = { obj, create_trace, destroy_trace, now, 0, true };
+        sh.history.push_back(rec);
+
+        if(addr.count++)
+            sh.record(addr.latest).next = seq;
+        else
+            addr.oldest = seq;
+
+        addr.latest = seq;
+
+        // the alive records of an address are always its newest ones,
+        // so the oldest is evicted and the next one takes its place
+        if(_retention.per_address && addr.count > _retention.per_address)
+        {
+            history_record& oldest = sh.record(addr.oldest);
+            oldest.alive = false;
+            addr.oldest = oldest.next;
+            --addr.count;
+            ++sh.history_dead;
+        }
+
+        // records are ordered by destruction time, so the oldest are in front
+        auto max_age = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                _retention.max_age).count();
+        size_t max_records = 0;
+
+        // the budget of a shard, rounded up so a small one keeps a record
+        if(_retention.max_bytes)
+        {
+            size_t shard_bytes = (_retention.max_bytes + shard_count - 1) / shard_count;
+            max_records = std::max<size_t>(1, (shard_bytes + history_record_bytes - 1) / history_record_bytes);
+        }
+
+        while(!sh.history.empty()
+                && ((max_age && now - sh.history.front().time > uint64_t(max_age))
+                    || (max_records && sh.history.size() > max_records)))
+        {
+            evict_front(sh);
+        }
+
+        // evicted records in the middle of the queue are removed when there are
+        // many of them, so the cost is amortized over the evictions
+        if(sh.history_dead > 64 && sh.history_dead > sh.history.size() / 2)
+            compact_history(sh);
+    }
+
+    // removes the oldest record; sh has to be locked
+    void evict_front(shard& sh)
+    {
+        const history_record& rec = sh.history.front();
+
+        // an alive record in front is the oldest one of its address
+        if(rec.alive)
+        {
+            auto it = sh.by_addr.find(rec.obj);
+            it->second.oldest = rec.next;
+
+            if(--it->second.count == 0)
+                sh.by_addr.erase(rec.obj);
+        }
+        else
+        {
+            --sh.history_dead;
+        }
+
+        sh.history.pop_front();
+        ++sh.history_first;
+    }
+
+    // drops the evicted records and renumbers the remaining ones; sh has to be locked
+    void compact_history(shard& sh)
+    {
+        std::deque<history_record> history;
+        flat_table<const T*, addr_history> by_addr;
+        uint64_t first = 1;
+
+        for(const history_record& rec : sh.history)
+        {
+            if(!rec.alive)
+                continue;
+
+            addr_history& addr = by_addr[rec.obj];
+            uint64_t seq = first + history.size();
+            history.push_back(rec);
+            history.back().next = 0;
+
+            if(addr.count++)
+                history[addr.latest - first].next = seq;
+            else
+                addr.oldest = seq;
+
+            addr.latest = seq;
+        }
+
+        sh.history.swap(history);
+        sh.by_addr.swap(by_addr);
+        sh.history_first = first;
+        sh.history_dead = 0;
+    }
+
+    // evicts the older half of the history, when the process uses too much memory
+    void trim_history()
+    {
+        for(shard& sh : _shards)
+        {
+            std::lock_guard<lock_type> lock(sh.lock);
+
+            for(size_t count = sh.history.size() / 2; count > 0; --count)
+                evict_front(sh);
+
+            if(sh.history_dead > sh.history.size() / 2)
+                compact_history(sh);
+        }
+    }
+
+    // resident set size of the process in bytes
+    static size_t resident_memory()
+    {
+        char buf[64];
+        int fd = open("/proc/self/statm", O_RDONLY);
+
+        if(fd < 0)
+            return 0;
+
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+
+        if(len <= 0)
+            return 0;
+
+        buf[len] = 0;
+        unsigned long size, resident;
+
+        if(sscanf(buf, "%lu %lu", &size, &resident) != 2)
+            return 0;
+
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    static const size_t rss_check_period = 65536;
+
+    // an object lifetime event, waiting in a log to be merged into the registry
+    struct event
+    {
+        const T* obj;
+        trace_store::trace_id trace;
+        uint32_t merge;         // merge that deferred the event, 0 if none
+        uint64_t generation;    // 0 for destruction events
+        uint64_t time;
+        size_t size;
+    };
+
+    // per-thread log of events: written only by its thread,
+    // read only by merge_logs() (while holding _logs_lock)
+    class event_ring
+    {
+    public:
+        event_ring() : _head(0), _tail(0)
+        {
+        }
+
+        // returns false if the log is full
+        bool push(const event& ev)
+        {
+            size_t head = _head.load(std::memory_order_relaxed);
+
+            if(head - _tail.load(std::memory_order_acquire) == capacity)
+                return false;
+
+            _events[head % capacity] = ev;
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        void drain(std::vector<event>& events)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            size_t head = _head.load(std::memory_order_acquire);
+
+            for(; tail != head; ++tail)
+                events.push_back(_events[tail % capacity]);
+
+            _tail.store(tail, std::memory_order_release);
+        }
+
+    private:
+        static const size_t capacity = 4096;
+
+        std::atomic<size_t> _head;
+        std::atomic<size_t> _tail;
+        event _events[capacity];
+    };
+
+    // owns the log of a thread, merges it when the thread exits
+    struct ring_owner
+    {
+        ring_owner(memcheck* check)
+            : check(check), ring(new event_ring())
+        {
+            std::lock_guard<std::mutex> lock(check->_logs_lock);
+            check->_rings.push_back(ring);
+        }
+
+        ~ring_owner()
+        {
+            check->merge_logs();
+            std::lock_guard<std::mutex> lock(check->_logs_lock);
+            check->_rings.erase(std::find(check->_rings.begin(), check->_rings.end(), ring));
+            delete ring;
+        }
+
+        memcheck* check;
+        event_ring* ring;
+    };
+
+    void log_event(const T* obj, trace_store::trace_id trace, uint64_t generation, size_t size)
+    {
+        // memcheck<T> is a singleton, so the log belongs to this instance
+        static thread_local ring_owner owner(this);
+        event ev = { obj, trace, 0, generation, timestamp(), size };
+
+        // the log is full, let the thread merge it and retry
+        while(!owner.ring->push(ev))
+            merge_logs();
+    }
+
+    static std::string type_name()
+    {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(typeid(T).name(), 0, 0, &status);
+        std::string name = demangled ? demangled : typeid(T).name();
+        free(demangled);
+        return name;
+    }
+
+    // destruction stack traces are captured only in the full mode
+    static trace_store::trace_id destroy_trace()
+    {
+        return Policy::mode == memcheck_mode::full
+            ? trace_store::get().capture(Policy::depth) : trace_store::no_trace;
+    }
+
+    // brings the registry up to date before it is queried; merging
+    // does not change the observable state, so it is fine for const methods
+    void sync() const
+    {
+        if(_storage == storage::event_log)
+            const_cast<memcheck*>(this)->merge_logs();
+    }
+
+    bool sampled(const T* obj)
+    {
+        sampling mode = _sampling.load(std::memory_order_relaxed);
+        unsigned rate = _sample_rate.load(std::memory_order_relaxed);
+
+        switch(mode)
+        {
+            case sampling::all:
+                return true;
+
+            case sampling::every_nth:
+                return _sample_counter.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+
+            case sampling::address_hash:
+            {
+                uint64_t h = reinterpret_cast<uintptr_t>(obj) * 0x9e3779b97f4a7c15ULL;
+                return (h >> 32) % rate == 0;
+            }
+        }
+
+        return true;
+    }
+
+    std::atomic<sampling> _sampling;
+    std::atomic<unsigned> _sample_rate;
+    std::atomic<unsigned> _sample_counter;
+
+    // count_only mode uses only these, so it scales with the number of threads
+    object_counters _counters;
+    std::atomic<size_t> _copied;
+    std::atomic<size_t> _moved;
+
+    retention _retention;
+    std::atomic<size_t> _history_added;
+
+    memcheck_switch _switch;
+
+    event_stream* _stream;
+    uint32_t _stream_type;
+
+    mapped_registry* _mapped;
+    uint32_t _mapped_type;
+
+    shard _shards[shard_count];
+
+    storage _storage;
+    std::mutex _logs_lock;
+    std::vector<event_ring*> _rings;
+    std::vector<event> _pending;        // events that did not fit during the last merge
+    uint32_t _merge_count;
+
+    std::thread _merger;
+    std::mutex _merger_lock;
+    std::condition_variable _merger_stop;
+    bool _merger_running;
+};
+
+// does not track anything; the hooks are inlined empty functions and the
+// instance is a constant-initialized empty object, so no code is generated
+template<typename T, typename Policy>
+class memcheck<T, Policy, false>
+{
+public:
+    typedef memcheck_sampling sampling;
+    typedef memcheck_storage storage;
+    typedef memcheck_handle<T> handle;
+    typedef memcheck_retention retention;
+
+    static memcheck& get()
+    {
+        static memcheck inst;
+        return inst;
+    }
+
+    handle created(const T*, size_t = 0)    { return handle(); }
+    bool destroyed(const T*)                { return true; }
+    void copied()                           {}
+    void moved()                            {}
+
+    bool released(const T*, trace_store::trace_id&, size_t&)        { return false; }
+    handle restored(const T*, trace_store::trace_id, size_t)        { return handle(); }
+
+    void reserve(size_t)                            {}
+    void set_sampling(sampling, unsigned)           {}
+    void set_retention(const retention&)            {}
+    void set_storage(storage)                       {}
+    void start_merger(std::chrono::milliseconds)    {}
+    void stop_merger()                              {}
+    void merge_logs()                               {}
+    void enable(bool)                               {}
+    void missed()                                   {}
+    void set_stream(event_stream*)                  {}
+    void set_mapped_registry(mapped_registry*)      {}
+    void configure(const char*)                     {}
+
+    bool enabled() const            { return false; }
+
+    size_t created_count() const    { return 0; }
+    size_t destroyed_count() const  { return 0; }
+    size_t live_count() const       { return 0; }
+    size_t copy_count() const       { return 0; }
+    size_t move_count() const       { return 0; }
+    size_t registered_count() const { return 0; }
+    size_t history_size() const     { return 0; }
+    size_t live_bytes() const       { return 0; }
+
+    bool exists(const T*) const         { return false; }
+    bool exists(const handle&) const    { return false; }
+
+    void show_create(const T* obj) const
+    {
+        std::cerr << obj << " is not tracked" << std::endl;
+    }
+
+    void show_destroy(const T* obj) const
+    {
+        std::cerr << obj << " is not tracked" << std::endl;
+    }
+
+    void show_objs(bool = false) const
+    {
+        std::cout << "existing objects:" << std::endl;
+    }
+
+    void show_sites() const
+    {
+        std::cout << "creation sites:" << std::endl;
+    }
+
+    void show_leaks(size_t = 3) const   {}
+    void show_leaks_at_exit()           {}
+
+    typedef memcheck_snapshot<T> snapshot_type;
+
+    snapshot_type snapshot() const  { return snapshot_type(); }
+
+    static std::vector<memcheck_site_diff> diff(const snapshot_type&, const snapshot_type&)
+    {
+        return std::vector<memcheck_site_diff>();
+    }
+
+    void show_diff(const snapshot_type&, const snapshot_type&) const {}
+
+    void dump(std::ostream& out) const
+    {
+        out.flush();
+    }
+};
+
+// true if memcheck_size(const T&) reports memory owned by T objects
+template<typename T, typename = void>
+struct memcheck_owns_memory : std::false_type
+{
+};
+
+template<typename T>
+struct memcheck_owns_memory<T, decltype(void(memcheck_size(std::declval<const T&>())))>
+    : std::true_type
+{
+};
+
+// base class registering all objects of a derived class, including the ones
+// created by copy and move constructors, e.g. class foo : public tracked<foo>.
+// Reports read memcheck_size() of the registered objects, so a class that
+// declares it before the class calls untrack() in its destructor, before
+// its members are gone.
+template<typename T, typename Policy = memcheck_traits<T>>
+class tracked
+{
+public:
+    typedef memcheck<T, Policy> registry_type;
+
+protected:
+    tracked()
+    {
+        registry().created(self());
+    }
+
+    tracked(const tracked&)
+    {
+        registry().created(self());
+        registry().copied();
+    }
+
+    // containers move their elements only if it cannot throw, so an object
+    // that cannot be registered (no memory) is left untracked instead
+    tracked(tracked&&) noexcept
+    {
+        try
+        {
+            registry().created(self());
+        }
+        catch(...)
+        {
+            registry().missed();
+        }
+
+        registry().moved();
+    }
+
+    // assignment does not change the object identity, it is only counted
+    tracked& operator=(const tracked&)
+    {
+        registry().copied();
+        return *this;
+    }
+
+    tracked& operator=(tracked&&) noexcept
+    {
+        registry().moved();
+        return *this;
+    }
+
+    // objects reporting owned memory are unregistered by untrack()
+    ~tracked()
+    {
+        if(!memcheck_owns_memory<T>::value)
+            registry().destroyed(self());
+    }
+
+    void untrack()
+    {
+        static_assert(memcheck_owns_memory<T>::value,
+                "only objects reporting memcheck_size() are unregistered early");
+        registry().destroyed(self());
+    }
+
+private:
+    // the derived object is not constructed yet (or anymore),
+    // but only its address is needed
+    const T* self() const
+    {
+        return static_cast<const T*>(this);
+    }
+
+    // the instance is cached, so it is not looked up for every object; objects
+    // created before the cache is initialized (during static initialization)
+    // look it up themselves. Disabled tracking has nothing to cache.
+    static registry_type& registry()
+    {
+        return registry(std::integral_constant<bool, Policy::mode != memcheck_mode::disabled>());
+    }
+
+    static registry_type& registry(std::true_type)
+    {
+        registry_type* reg = _registry.load(std::memory_order_relaxed);
+        return reg ? *reg : registry_type::get();
+    }
+
+    static registry_type& registry(std::false_type)
+    {
+        return registry_type::get();
+    }
+
+    static std::atomic<registry_type*> _registry;
+};
+
+template<typename T, typename Policy>
+std::atomic<typename tracked<T, Policy>::registry_type*> tracked<T, Policy>::_registry(
+        &tracked<T, Policy>::registry_type::get());
+
 #endif /* MEMCHECK_H */
@@ -0,0 +1,433 @@
+/*
+ * memcheck - C++ debug utility for tracking objects lifetime
+ *
+ * Copyright (C) 2017 Maciej Suminski <orson@orson.net.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcheck.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct entry
+{
+    void* create_trace;
+    void* destroy_trace;
+};
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+// addresses laid out the way a heap allocator would hand them out,
+// then shuffled so lookups do not walk the keys in order
+static std::vector<const void*> make_keys(size_t count)
+{
+    std::vector<const void*> keys(count);
+
+    for(size_t i = 0; i < count; ++i)
+        keys[i] = reinterpret_cast<const void*>(0x7f0000000000ULL + i * 48);
+
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(count));
+    return keys;
+}
+
+template<typename Map>
+static void bench_registry(const char* name, const std::vector<const void*>& keys)
+{
+    Map map;
+    size_t found = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(const void* key : keys)
+        map[key].create_trace = nullptr;
+    double insert = elapsed_ns(start) / keys.size();
+
+    start = std::chrono::steady_clock::now();
+    for(const void* key : keys)
+        found += (map.find(key) != map.end());
+    double lookup = elapsed_ns(start) / keys.size();
+
+    start = std::chrono::steady_clock::now();
+    for(const void* key : keys)
+        map.erase(key);
+    double erase = elapsed_ns(start) / keys.size();
+
+    assert(found == keys.size());
+    std::cout << "  " << name << ": insert " << insert << " ns, lookup "
+              << lookup << " ns, erase " << erase << " ns" << std::endl;
+}
+
+// recurses until the stack is depth frames deep, then measures
+// the time needed to capture the stack trace with a given method
+__attribute__((noinline))
+static double bench_capture(int depth, call_stack::unwinder method, int iterations)
+{
+    if(depth > 1)
+    {
+        double ns = bench_capture(depth - 1, method, iterations);
+        asm volatile("" ::: "memory");      // prevent tail calls
+        return ns;
+    }
+
+    void* frames[call_stack::depth];
+    int num_frames = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; ++i)
+        num_frames += call_stack::capture(frames, call_stack::depth, method);
+    double ns = elapsed_ns(start) / iterations;
+
+    assert(num_frames > 0);
+    return ns;
+}
+
+static void bench_unwinders()
+{
+    const int iterations = 100000;
+
+    std::cout << "stack capture (per trace):" << std::endl;
+
+    for(int depth : { 8, 16, 40 })
+    {
+        // main() and libc start up frames come on top of that
+        double bt = bench_capture(depth, call_stack::unwinder::backtrace, iterations);
+        double fp = bench_capture(depth, call_stack::unwinder::frame_pointer, iterations);
+        double eh = bench_capture(depth, call_stack::unwinder::eh_frame, iterations);
+
+        std::cout << "  depth " << depth << ": backtrace " << bt
+                  << " ns, frame_pointer " << fp << " ns, eh_frame "
+                  << eh << " ns" << std::endl;
+    }
+}
+
+struct bench_obj
+{
+    char data[32];
+};
+
+struct bench_counted_obj
+{
+    char data[32];
+};
+
+template<>
+struct memcheck_traits<bench_counted_obj> : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::count_only;
+};
+
+// the same work as memcheck<T>, but with a single lock guarding the registry
+struct single_lock_registry
+{
+    void created(const bench_obj* obj)
+    {
+        trace_store::trace_id trace = trace_store::get().capture();
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[obj] = trace;
+    }
+
+    void destroyed(const bench_obj* obj)
+    {
+        trace_store::get().capture();
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.erase(obj);
+    }
+
+    std::mutex mutex;
+    flat_table<const bench_obj*, trace_store::trace_id> entries;
+};
+
+// creates and destroys objects in a number of threads, returns millions of
+// tracked objects per second
+template<typename Registry, typename Obj = bench_obj>
+static double bench_threads(Registry& registry, int num_threads)
+{
+    const int iterations = 200000;
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&registry]() {
+            Obj* objs[16];
+
+            for(int i = 0; i < iterations; i += 16)
+            {
+                for(Obj*& obj : objs)
+                {
+                    obj = new Obj();
+                    registry.created(obj);
+                }
+
+                for(Obj* obj : objs)
+                {
+                    registry.destroyed(obj);
+                    delete obj;
+                }
+            }
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    return num_threads * iterations * 1e3 / elapsed_ns(start);
+}
+
+struct bench_logged_obj
+{
+    char data[32];
+};
+
+struct bench_streamed_obj
+{
+    char data[32];
+};
+
+struct bench_mapped_obj
+{
+    char data[32];
+};
+
+struct bench_reported_obj
+{
+    char data[32];
+};
+
+struct bench_switched_obj
+{
+    char data[32];
+};
+
+struct bench_disabled_obj
+{
+    char data[32];
+};
+
+template<>
+struct memcheck_traits<bench_disabled_obj> : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::disabled;
+};
+
+// average cost of created() + destroyed() of a single object
+template<typename Obj>
+static double bench_hook_cost()
+{
+    const int iterations = 1000000;
+    memcheck<Obj>& check = memcheck<Obj>::get();
+    Obj obj;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; ++i)
+    {
+        check.created(&obj);
+        check.destroyed(&obj);
+    }
+
+    return elapsed_ns(start) / (2 * iterations);
+}
+
+static void bench_hooks()
+{
+    call_stack::set_unwinder(call_stack::unwinder::frame_pointer);
+    memcheck<bench_logged_obj>::get().set_storage(memcheck<bench_logged_obj>::storage::event_log);
+
+    double registry = bench_hook_cost<bench_obj>();
+    double event_log = bench_hook_cost<bench_logged_obj>();
+
+    // without a merger thread, the event log is merged by the
+    // logging thread whenever it fills up, so that cost is included
+    std::cout << "hook cost (frame pointer unwinder): registry " << registry
+              << " ns, event log " << event_log << " ns" << std::endl;
+
+    // events written to a binary log, without keeping them in memory
+    event_stream stream;
+    stream.open("/dev/null");
+    memcheck<bench_streamed_obj>& streamed = memcheck<bench_streamed_obj>::get();
+    streamed.set_storage(memcheck<bench_streamed_obj>::storage::stream);
+    streamed.set_stream(&stream);
+    std::cout << "hook cost: event stream " << bench_hook_cost<bench_streamed_obj>()
+              << " ns" << std::endl;
+    streamed.set_stream(nullptr);
+
+    // existing objects kept in a memory-mapped file
+    const char* mapped_path = "/tmp/memcheck_bench.map";
+    mapped_registry mapped_reg;
+    mapped_reg.open(mapped_path);
+    memcheck<bench_mapped_obj>& mapped = memcheck<bench_mapped_obj>::get();
+    mapped.set_storage(memcheck<bench_mapped_obj>::storage::stream);
+    mapped.set_mapped_registry(&mapped_reg);
+    std::cout << "hook cost: mapped registry " << bench_hook_cost<bench_mapped_obj>()
+              << " ns" << std::endl;
+    mapped.set_mapped_registry(nullptr);
+    unlink(mapped_path);
+
+    // the disabled hooks are removed by the compiler, the loop measures nothing
+    std::cout << "hook cost: count only " << bench_hook_cost<bench_counted_obj>()
+              << " ns, disabled " << bench_hook_cost<bench_disabled_obj>() << " ns" << std::endl;
+
+    // tracking switched off at run time costs a load and a branch
+    memcheck<bench_switched_obj>::get().enable(false);
+    std::cout << "hook cost: switched off " << bench_hook_cost<bench_switched_obj>()
+              << " ns" << std::endl;
+
+    call_stack::set_unwinder(call_stack::unwinder::backtrace);
+}
+
+static void bench_scalability()
+{
+    std::cout << "threads (millions of objects per second):" << std::endl;
+    call_stack::set_unwinder(call_stack::unwinder::frame_pointer);
+
+    for(int num_threads : { 1, 2, 4, 8, 16, 32, 64 })
+    {
+        single_lock_registry single;
+        double sharded = bench_threads(memcheck<bench_obj>::get(), num_threads);
+
+        double counted = bench_threads<memcheck<bench_counted_obj>, bench_counted_obj>(
+                memcheck<bench_counted_obj>::get(), num_threads);
+
+        std::cout << "  " << num_threads << " threads: sharded " << sharded
+                  << ", single lock " << bench_threads(single, num_threads)
+                  << ", count only " << counted << std::endl;
+    }
+
+    call_stack::set_unwinder(call_stack::unwinder::backtrace);
+}
+
+// time a thread asking for a report is stalled, when the report is written
+// by the calling thread and by the writer thread
+static void bench_reports()
+{
+    const size_t count = 100000;
+    std::vector<bench_reported_obj> objs(count);
+    memcheck<bench_reported_obj>& check = memcheck<bench_reported_obj>::get();
+    int fd = open("/dev/null", O_WRONLY);
+
+    for(bench_reported_obj& obj : objs)
+        check.created(&obj);
+
+    // the first report resolves the symbols, the following ones are cached
+    report_writer& writer = report_writer::get();
+    writer.start(fd);
+    check.show_objs(true);
+    writer.flush();
+
+    auto start = std::chrono::steady_clock::now();
+    check.show_objs(true);
+    double queued = elapsed_ns(start);
+    writer.flush();
+    double written = elapsed_ns(start);
+
+    std::cout << "report of " << count << " objects with stacks: caller stalled "
+              << queued / 1e6 << " ms, written in " << written / 1e6 << " ms" << std::endl;
+
+    // the same objects grouped by creation site
+    start = std::chrono::steady_clock::now();
+    check.show_leaks();
+    writer.flush();
+    std::cout << "leak report of " << count << " objects: " << elapsed_ns(start) / 1e6
+              << " ms" << std::endl;
+    writer.stop();
+
+    for(bench_reported_obj& obj : objs)
+        check.destroyed(&obj);
+
+    close(fd);
+}
+
+// time to resolve a report with 10k distinct code addresses, spread over
+// the whole program, so almost none of them shares a cached symbol
+static void bench_symbols()
+{
+    const size_t count = 10000;
+    module_table& modules = module_table::get();
+    const module_table::module& exe = modules[modules.find(reinterpret_cast<void*>(&bench_symbols))];
+    elf_image image(exe.path);
+    elf_image::section text = image.find_section(".text");
+    std::vector<uint64_t> offsets;
+
+    for(size_t i = 0; i < count; ++i)
+        offsets.push_back(text.addr + text.size * i / count);
+
+    // the symbolizing tools load the debug information on the first lookup
+    offline_symbolizer symbolizer;
+    symbolizer.add_module(0, exe.path, exe.build_id);
+    std::vector<std::string> inlined;
+    size_t num_inlined = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(uint64_t offset : offsets)
+    {
+        inlined.clear();
+        symbolizer.resolve(0, offset, &inlined);
+        num_inlined += inlined.size();
+    }
+
+    std::cout << "symbolized " << count << " frames offline (" << num_inlined
+              << " inlined calls): " << elapsed_ns(start) / 1e6
+              << " ms, including loading debug information" << std::endl;
+
+    // in the process, the debug information has been loaded by the reports
+    start = std::chrono::steady_clock::now();
+
+    for(uint64_t offset : offsets)
+        symbol_cache::get().resolve(reinterpret_cast<const void*>(exe.base + offset));
+
+    std::cout << "resolved " << count << " frames in the process: "
+              << elapsed_ns(start) / 1e6 << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<size_t> sizes = { 1000000, 10000000 };
+
+    if(argc > 1)
+    {
+        sizes.clear();
+        for(int i = 1; i < argc; ++i)
+            sizes.push_back(strtoul(argv[i], nullptr, 10));
+    }
+
+    bench_unwinders();
+    bench_hooks();
+    bench_scalability();
+    bench_reports();
+    bench_symbols();
+
+    std::cout << "registry (per operation):" << std::endl;
+
+    for(size_t count : sizes)
+    {
+        std::vector<const void*> keys = make_keys(count);
+
+        std::cout << count << " entries" << std::endl;
+        bench_registry<std::map<const void*, entry>>("std::map  ", keys);
+        bench_registry<flat_table<const void*, entry>>("flat_table", keys);
+    }
+
+    return 0;
+}
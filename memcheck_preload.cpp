@@ -0,0 +1,323 @@
+/*
+ * memcheck - C++ debug utility for tracking objects lifetime
+ *
+ * Copyright (C) 2017 Maciej Suminski <orson@orson.net.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// libmemcheck_preload.so - tracks heap blocks of any program, no need
+// to recompile it
+//
+// usage: LD_PRELOAD=./libmemcheck_preload.so program
+//
+// malloc() & co. and operator new/delete are replaced with functions that
+// register sampled blocks in memcheck<heap_block>. Environment variables:
+//   MEMCHECK_SAMPLE_BYTES  on average one block per that many allocated
+//                          bytes is sampled (default 65536, 1 samples all)
+//   MEMCHECK_DUMP          file to write the existing blocks to at exit,
+//                          to be read by memcheck-symbolize
+//   MEMCHECK_MAPPED        file keeping the existing blocks while the program
+//                          runs, to be read by memcheck-postmortem if it crashes
+//   MEMCHECK               e.g. MEMCHECK=heap_block:off, see memcheck<T>::configure()
+
+#include "memcheck.hpp"
+
+#include <cerrno>
+#include <fstream>
+
+// allocator functions of glibc, they are not interposed
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void* __libc_valloc(size_t size);
+    void* __libc_pvalloc(size_t size);
+    void __libc_free(void* ptr);
+}
+
+// an untyped heap block
+struct heap_block
+{
+};
+
+// destruction stack traces are not that interesting for untyped memory
+template<>
+struct memcheck_traits<heap_block> : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::create_trace;
+};
+
+// set once the library is initialized, until the report is written
+static bool ready = false;
+
+static size_t sample_bytes = 65536;
+
+// never destroyed, blocks may be freed until the very end
+static mapped_registry* mapped = nullptr;
+
+// tls variables of a preloaded library are allocated statically,
+// so accessing them does not allocate memory
+#define PRELOAD_TLS static __thread __attribute__((tls_model("initial-exec")))
+
+// set while memcheck is working; memory it allocates for itself goes
+// directly to glibc, so it is neither tracked nor recursing
+PRELOAD_TLS bool in_hook;
+
+// bytes to be allocated by the thread before the next sample
+PRELOAD_TLS long bytes_until_sample;
+PRELOAD_TLS uint32_t random_state;
+
+// counting filter of sampled block addresses, so most blocks are
+// freed without looking them up in the registry
+static const size_t filter_size = 1 << 20;
+static std::atomic<uint16_t> sampled_filter[filter_size];
+
+static std::atomic<uint16_t>& filter_slot(const void* ptr)
+{
+    uint64_t h = reinterpret_cast<uintptr_t>(ptr) * 0x9e3779b97f4a7c15ULL;
+    return sampled_filter[h >> 44];
+}
+
+class hook_guard
+{
+public:
+    hook_guard()    { in_hook = true; }
+    ~hook_guard()   { in_hook = false; }
+};
+
+// intervals between samples are randomized, so the samples do not follow
+// allocation patterns; the mean interval is sample_bytes
+static long next_sample_interval()
+{
+    if(random_state == 0)
+        random_state = reinterpret_cast<uintptr_t>(&random_state) | 1;
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return sample_bytes / 2 + random_state % sample_bytes;
+}
+
+static void* allocated(void* ptr, size_t size)
+{
+    if(!ptr || !ready || in_hook)
+        return ptr;
+
+    bytes_until_sample -= size;
+
+    if(bytes_until_sample > 0)
+        return ptr;
+
+    bytes_until_sample = next_sample_interval();
+
+    hook_guard guard;
+
+    if(memcheck<heap_block>::get().created(static_cast<const heap_block*>(ptr), size))
+        filter_slot(ptr).fetch_add(1, std::memory_order_relaxed);
+
+    return ptr;
+}
+
+// unregisters a block before it is freed, as another thread may be given
+// the same address right after that; its stack trace and size are kept,
+// so it can be registered again by restore() if it is not freed after all
+static bool release(void* ptr, trace_store::trace_id& trace, size_t& size)
+{
+    if(!ptr || in_hook || filter_slot(ptr).load(std::memory_order_relaxed) == 0)
+        return false;
+
+    hook_guard guard;
+
+    // another sampled block might share the filter slot
+    if(!memcheck<heap_block>::get().released(static_cast<const heap_block*>(ptr), trace, size))
+        return false;
+
+    filter_slot(ptr).fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+static void restore(void* ptr, trace_store::trace_id trace, size_t size)
+{
+    hook_guard guard;
+    memcheck<heap_block>::get().restored(static_cast<const heap_block*>(ptr), trace, size);
+    filter_slot(ptr).fetch_add(1, std::memory_order_relaxed);
+}
+
+static void freed(void* ptr)
+{
+    trace_store::trace_id trace;
+    size_t size;
+    release(ptr, trace, size);
+}
+
+__attribute__((constructor))
+static void preload_init()
+{
+    hook_guard guard;
+
+    if(const char* bytes = getenv("MEMCHECK_SAMPLE_BYTES"))
+        sample_bytes = std::max(1UL, strtoul(bytes, nullptr, 10));
+
+    memcheck<heap_block>& check = memcheck<heap_block>::get();
+
+    if(const char* path = getenv("MEMCHECK_MAPPED"))
+    {
+        mapped = new mapped_registry();
+
+        if(mapped->open(path))
+            check.set_mapped_registry(mapped);
+        else
+            std::cerr << "memcheck: cannot create " << path << std::endl;
+    }
+
+    ready = true;
+}
+
+__attribute__((destructor))
+static void preload_report()
+{
+    hook_guard guard;
+    memcheck<heap_block>& check = memcheck<heap_block>::get();
+    ready = false;
+
+    std::cerr << "memcheck: " << check.registered_count() << " sampled heap blocks exist, "
+              << check.live_bytes() << " bytes (1 per " << sample_bytes << " bytes)" << std::endl;
+
+    if(const char* path = getenv("MEMCHECK_DUMP"))
+    {
+        std::ofstream out(path);
+        check.dump(out);
+    }
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    return allocated(__libc_malloc(size), size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    return allocated(__libc_calloc(count, size), count * size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    trace_store::trace_id trace;
+    size_t old_size;
+    bool released = release(ptr, trace, old_size);
+    void* block = __libc_realloc(ptr, size);
+
+    // a failed realloc() leaves the block untouched,
+    // realloc(ptr, 0) frees it and returns null
+    if(released && !block && size != 0)
+        restore(ptr, trace, old_size);
+
+    return allocated(block, size);
+}
+
+void free(void* ptr)
+{
+    freed(ptr);
+    __libc_free(ptr);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size), size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size), size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void* block = __libc_memalign(alignment, size);
+
+    if(!block)
+        return ENOMEM;
+
+    *ptr = allocated(block, size);
+    return 0;
+}
+
+void* valloc(size_t size)
+{
+    return allocated(__libc_valloc(size), size);
+}
+
+void* pvalloc(size_t size)
+{
+    return allocated(__libc_pvalloc(size), size);
+}
+
+} // extern "C"
+
+static void* new_block(size_t size)
+{
+    void* ptr = malloc(size);
+
+    if(!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+static void* new_block(size_t size, std::align_val_t alignment)
+{
+    void* ptr = aligned_alloc(static_cast<size_t>(alignment), size);
+
+    if(!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void* operator new(size_t size)                     { return new_block(size); }
+void* operator new[](size_t size)                   { return new_block(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept     { return malloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept   { return malloc(size); }
+
+void* operator new(size_t size, std::align_val_t alignment)     { return new_block(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment)   { return new_block(size, alignment); }
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return aligned_alloc(static_cast<size_t>(alignment), size);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return aligned_alloc(static_cast<size_t>(alignment), size);
+}
+
+void operator delete(void* ptr) noexcept                            { free(ptr); }
+void operator delete[](void* ptr) noexcept                          { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept                    { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept                  { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept     { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept   { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept          { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept        { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept  { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
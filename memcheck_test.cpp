@@ -19,6 +19,14 @@
 
 #include "memcheck.hpp"
 #include <cassert>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 // tracked class
 class foo
@@ -35,6 +43,124 @@ public:
     }
 };
 
+// tracked class, sampled
+class bar
+{
+public:
+    bar()
+    {
+        memcheck<bar>::get().created(this);
+    }
+
+    ~bar()
+    {
+        memcheck<bar>::get().destroyed(this);
+    }
+};
+
+// tracked class, stored in per-thread event logs
+class baz
+{
+public:
+    baz()
+    {
+        memcheck<baz>::get().created(this);
+    }
+
+    ~baz()
+    {
+        memcheck<baz>::get().destroyed(this);
+    }
+};
+
+// tracked class, with a bounded history of destroyed objects,
+// keeps a handle to validate pointers to it
+class qux
+{
+public:
+    qux()
+    {
+        self = memcheck<qux>::get().created(this);
+    }
+
+    ~qux()
+    {
+        memcheck<qux>::get().destroyed(this);
+    }
+
+    memcheck<qux>::handle self;
+};
+
+// tracked class, with tracking disabled at compile time
+class quux;
+
+template<>
+struct memcheck_traits<quux> : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::disabled;
+};
+
+class quux
+{
+public:
+    quux()
+    {
+        memcheck<quux>::get().created(this);
+    }
+
+    ~quux()
+    {
+        memcheck<quux>::get().destroyed(this);
+    }
+};
+
+// tracked class, registered by its base class
+class widget : public tracked<widget>
+{
+public:
+    std::vector<int> data;
+};
+
+// the same, but with tracking disabled
+class gadget;
+
+template<>
+struct memcheck_traits<gadget> : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::disabled;
+};
+
+class gadget : public tracked<gadget>
+{
+public:
+    int data;
+};
+
+// tracked class owning heap memory, which is reported by memcheck_size()
+class buffer;
+size_t memcheck_size(const buffer& buf);
+
+class buffer : public tracked<buffer>
+{
+public:
+    buffer(size_t size) : data(size)
+    {
+    }
+
+    // reports may read the data until the object is unregistered
+    ~buffer()
+    {
+        untrack();
+    }
+
+    std::vector<char> data;
+};
+
+size_t memcheck_size(const buffer& buf)
+{
+    return buf.data.capacity();
+}
+
 // to make stack traces more interesting, we need to create/destroy
 // objects in functions other than main()
 foo* create_foo()
@@ -47,8 +173,931 @@ void destroy_foo(foo* a)
     delete a;
 }
 
-int main()
+// create and destroy many objects, so the registry has to grow and
+// reuse its slots
+void churn_foo()
+{
+    std::vector<foo*> objs;
+
+    memcheck<foo>::get().reserve(1000);
+
+    for(int round = 0; round < 3; ++round)
+    {
+        for(int i = 0; i < 1000; ++i)
+            objs.push_back(create_foo());
+
+        // destroy every other object
+        for(size_t i = 0; i < objs.size(); i += 2)
+        {
+            destroy_foo(objs[i]);
+            assert(memcheck<foo>::get().exists(objs[i]) == false);
+            objs[i] = nullptr;
+        }
+
+        for(foo* obj : objs)
+            assert(!obj || memcheck<foo>::get().exists(obj));
+
+        objs.erase(std::remove(objs.begin(), objs.end(), nullptr), objs.end());
+    }
+
+    for(foo* obj : objs)
+        destroy_foo(obj);
+}
+
+// captures a stack trace with the given method, always from the same place
+__attribute__((noinline))
+int capture_stack(void** frames, call_stack::unwinder method)
+{
+    return call_stack::capture(frames, call_stack::depth, method);
+}
+
+void test_unwinders()
+{
+    const call_stack::unwinder methods[] = {
+        call_stack::unwinder::backtrace,
+        call_stack::unwinder::frame_pointer,
+        call_stack::unwinder::eh_frame
+    };
+    const int num_methods = sizeof(methods) / sizeof(methods[0]);
+    void* frames[num_methods][call_stack::depth];
+    int num_frames[num_methods];
+
+    for(int i = 0; i < num_methods; ++i)
+        num_frames[i] = capture_stack(frames[i], methods[i]);
+
+    // compare with backtrace(); the frame pointer chain may end earlier (libc
+    // start up code is usually compiled without frame pointers), but the
+    // remaining frames have to match, except for the first one, which is
+    // inside call_stack::capture()
+    for(int m = 1; m < num_methods; ++m)
+    {
+        int common = std::min(num_frames[0], num_frames[m]);
+        assert(common >= 3);
+
+        for(int i = 1; i < common; ++i)
+            assert(frames[0][i] == frames[m][i]);
+    }
+
+    assert(num_frames[2] == num_frames[0]);
+}
+
+// addresses outside of any module do not add the known modules again
+void test_modules()
+{
+    module_table& modules = module_table::get();
+    int exe = modules.find(reinterpret_cast<void*>(&test_modules));
+    size_t count = modules.size();
+    assert(exe >= 0);
+
+    for(int i = 0; i < 5; ++i)
+        assert(modules.find(reinterpret_cast<void*>(16)) < 0);
+
+    assert(modules.size() == count);
+    assert(modules.find(reinterpret_cast<void*>(&test_modules)) == exe);
+
+    // loading a library changes the loader generation, which makes
+    // the unwinder drop the rules cached for unknown code
+    uint64_t generation = module_table::loader_generation();
+    void* lib = dlopen("libanl.so.1", RTLD_NOW);
+    assert(lib && module_table::loader_generation() != generation);
+    dlclose(lib);
+}
+
+// inlined even without optimization, so its call appears in the debug information
+__attribute__((always_inline))
+inline std::string inlined_trace()
+{
+    call_stack st;
+    return st.as_string();
+}
+
+// functions inlined at a frame address are listed before the function they
+// were inlined into, which reports the line where the inlined one was called
+void test_inlined()
+{
+    std::string trace = inlined_trace();
+    size_t inlined = trace.find("inlined_trace");
+    size_t caller = trace.find("test_inlined");
+
+    assert(inlined != std::string::npos && caller != std::string::npos && inlined < caller);
+    assert(trace.find("(inlined) in ", inlined) < trace.find('\n', inlined));
+    assert(trace.find("memcheck_test.cpp", caller) < trace.find('\n', caller));
+}
+
+void test_sampling()
+{
+    memcheck<bar>& check = memcheck<bar>::get();
+    std::vector<bar*> objs;
+
+    check.set_sampling(memcheck<bar>::sampling::every_nth, 10);
+
+    for(int i = 0; i < 1000; ++i)
+        objs.push_back(new bar());
+
+    // only sampled objects are registered, but all of them are counted
+    assert(check.live_count() == 1000);
+    assert(check.registered_count() == 100);
+
+    for(bar* obj : objs)
+        delete obj;
+
+    assert(check.live_count() == 0);
+    assert(check.created_count() == 1000);
+
+    // the same addresses are chosen for construction and destruction
+    check.set_sampling(memcheck<bar>::sampling::address_hash, 4);
+    objs.clear();
+
+    for(int i = 0; i < 1000; ++i)
+        objs.push_back(new bar());
+
+    for(bar* obj : objs)
+        delete obj;
+
+    for(bar* obj : objs)
+        assert(!check.exists(obj));
+
+    assert(check.live_count() == 0);
+}
+
+// objects created and destroyed concurrently
+void test_threads()
+{
+    memcheck<bar>& check = memcheck<bar>::get();
+    std::vector<std::thread> threads;
+    size_t live = check.live_count();
+
+    check.set_sampling(memcheck<bar>::sampling::all, 1);
+
+    for(int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&check]() {
+            std::vector<bar*> objs;
+
+            for(int i = 0; i < 1000; ++i)
+                objs.push_back(new bar());
+
+            for(bar* obj : objs)
+                assert(check.exists(obj));
+
+            for(bar* obj : objs)
+                delete obj;
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    assert(check.live_count() == live);
+}
+
+// objects created in one thread and destroyed in another one,
+// so the events end up in different logs
+void test_event_log()
+{
+    memcheck<baz>& check = memcheck<baz>::get();
+    std::vector<baz*> objs[4];
+    std::vector<std::thread> threads;
+
+    check.set_storage(memcheck<baz>::storage::event_log);
+
+    for(int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&objs, t]() {
+            for(int i = 0; i < 10000; ++i)
+                objs[t].push_back(new baz());
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    threads.clear();
+
+    // logs of the finished threads have been merged
+    assert(check.registered_count() == 40000);
+
+    for(int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&objs, t]() {
+            for(baz* obj : objs[(t + 1) % 4])
+                delete obj;
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    for(int t = 0; t < 4; ++t)
+    {
+        for(baz* obj : objs[t])
+            assert(!check.exists(obj));
+    }
+
+    // events logged by the main thread are merged by queries
+    baz* obj = new baz();
+    assert(check.exists(obj));
+    delete obj;
+    assert(!check.exists(obj));
+    assert(check.live_count() == 0);
+}
+
+// objects destroyed at the same addresses over and over again
+// do not make the history grow
+void test_retention()
+{
+    memcheck<qux>& check = memcheck<qux>::get();
+    memcheck<qux>::retention policy;
+    policy.per_address = 2;
+    check.set_retention(policy);
+
+    alignas(qux) char buf[sizeof(qux)];
+
+    for(int i = 0; i < 10; ++i)
+    {
+        qux* obj = new(buf) qux();
+        assert(check.exists(obj));
+        obj->~qux();
+        assert(!check.exists(obj));
+    }
+
+    assert(check.history_size() == 2);
+    check.show_destroy(reinterpret_cast<qux*>(buf));
+
+    // the allocator reuses a few addresses
+    for(int i = 0; i < 100000; ++i)
+        delete new qux();
+
+    std::cout << "history of destroyed objects: " << check.history_size() << std::endl;
+    assert(check.history_size() < 1000);
+    assert(check.live_count() == 0);
+
+    // a budget smaller than a record for each shard keeps the latest record
+    // of each shard, instead of no limit at all
+    policy.per_address = 0;
+    policy.max_bytes = 1;
+    check.set_retention(policy);
+
+    {
+        std::vector<qux> objs(1000);
+    }
+
+    assert(check.history_size() > 0 && check.history_size() <= 64);
+    check.set_retention(memcheck<qux>::retention());
+}
+
+// a stale pointer to a destroyed object is recognized, even when another
+// object has been created at the same address
+void test_generations()
+{
+    memcheck<qux>& check = memcheck<qux>::get();
+    alignas(qux) char buf[sizeof(qux)];
+
+    qux* obj = new(buf) qux();
+    memcheck<qux>::handle old_obj = obj->self;
+    assert(check.exists(old_obj));
+    obj->~qux();
+    assert(!check.exists(old_obj));
+
+    obj = new(buf) qux();
+    assert(obj == old_obj.obj);
+    assert(check.exists(obj));
+    assert(!check.exists(old_obj));
+    assert(check.exists(obj->self));
+    obj->~qux();
+}
+
+// policies selected at compile time
+struct counting_policy : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::count_only;
+};
+
+struct shallow_policy : memcheck_default_traits
+{
+    static const memcheck_mode mode = memcheck_mode::create_trace;
+    static const int depth = 4;
+    typedef null_lock lock_type;
+};
+
+void test_policies()
+{
+    // disabled tracking has no state
+    static_assert(std::is_empty<memcheck<quux>>::value, "disabled memcheck is not empty");
+    quux* q = new quux();
+    assert(!memcheck<quux>::get().exists(q));
+    delete q;
+    assert(memcheck<quux>::get().created_count() == 0);
+
+    int obj;
+    memcheck<int, counting_policy>& counter = memcheck<int, counting_policy>::get();
+    counter.created(&obj);
+    assert(counter.created_count() == 1);
+    assert(counter.registered_count() == 0);
+    counter.destroyed(&obj);
+    assert(counter.live_count() == 0);
+
+    memcheck<int, shallow_policy>& check = memcheck<int, shallow_policy>::get();
+    check.created(&obj);
+    assert(check.exists(&obj));
+
+    // "trace id" followed by at most 4 frames
+    std::ostringstream report;
+    check.dump(report);
+    std::string line = report.str().substr(report.str().find("trace "));
+    line = line.substr(0, line.find('\n'));
+    assert(std::count(line.begin(), line.end(), ' ') <= 5);
+
+    check.destroyed(&obj);
+    assert(!check.exists(&obj));
+}
+
+// tracking switched off and on again at run time
+void test_switch()
+{
+    memcheck<short>& check = memcheck<short>::get();
+    short untracked, tracked;
+
+    check.enable(false);
+    assert(!check.created(&untracked));
+    check.enable(true);
+
+    // objects created while tracking was off are ignored
+    check.created(&tracked);
+    assert(check.exists(&tracked));
+    assert(!check.exists(&untracked));
+    check.show_create(&untracked);
+    check.destroyed(&untracked);
+    check.destroyed(&tracked);
+    assert(check.created_count() == 1);
+    assert(check.destroyed_count() == 1);
+
+    // objects that are not registered cannot be told apart, but the number
+    // of existing objects does not wrap around
+    int off_int;
+    memcheck<int, counting_policy>& counter = memcheck<int, counting_policy>::get();
+    counter.enable(false);
+    counter.created(&off_int);
+    counter.enable(true);
+    counter.destroyed(&off_int);
+    assert(counter.live_count() == 0);
+
+    memcheck<bar>& sampled_bars = memcheck<bar>::get();
+    size_t live_bars = sampled_bars.live_count();
+    bar* off_bars[8];
+    sampled_bars.set_sampling(memcheck<bar>::sampling::every_nth, 10);
+    sampled_bars.enable(false);
+
+    for(bar*& b : off_bars)
+        b = new bar();
+
+    sampled_bars.enable(true);
+
+    for(bar* b : off_bars)
+        delete b;
+
+    assert(sampled_bars.live_count() <= live_bars);
+
+    // settings read from the environment when the type is used for the first time
+    setenv("MEMCHECK", "char:sample=10,unsigned char:off", 1);
+    memcheck<char>& sampled = memcheck<char>::get();
+    memcheck<unsigned char>& disabled = memcheck<unsigned char>::get();
+    char chars[100];
+
+    for(char& c : chars)
+        sampled.created(&c);
+
+    assert(sampled.registered_count() == 10);
+    assert(!disabled.enabled());
+
+    // the signal toggles all tracked types
+    memcheck_switch::toggle_on_signal(SIGUSR1);
+    raise(SIGUSR1);
+    assert(!check.enabled());
+    assert(disabled.enabled());
+    raise(SIGUSR1);
+    assert(check.enabled());
+    assert(!disabled.enabled());
+}
+
+// copies and moves are registered as new objects and counted
+void test_tracked()
+{
+    memcheck<widget>& check = memcheck<widget>::get();
+
+    {
+        widget a;
+        widget b(a);
+        widget c(std::move(a));
+        assert(check.exists(&a) && check.exists(&b) && check.exists(&c));
+        assert(check.live_count() == 3);
+
+        b = c;
+        c = std::move(b);
+        assert(check.copy_count() == 2);
+        assert(check.move_count() == 2);
+    }
+
+    assert(check.live_count() == 0);
+
+    // containers still move the objects, rather than copy them
+    static_assert(std::is_nothrow_move_constructible<widget>::value, "widget moves may throw");
+
+    // disabled tracking does not make objects bigger
+    static_assert(sizeof(gadget) == sizeof(int), "tracked<T> takes space");
+    gadget g;
+    assert(!memcheck<gadget>::get().exists(&g));
+}
+
+buffer* create_big_buffer()
+{
+    return new buffer(1 << 20);
+}
+
+// memory held by objects is reported, the biggest first
+void test_bytes()
+{
+    memcheck<buffer>& check = memcheck<buffer>::get();
+    std::vector<buffer*> small;
+
+    for(int i = 0; i < 10; ++i)
+        small.push_back(new buffer(16));
+
+    buffer* big = create_big_buffer();
+    assert(check.live_bytes() == (1 << 20) + 10 * 16 + 11 * sizeof(buffer));
+
+    check.show_sites();
+
+    std::ostringstream report;
+    check.dump(report);
+    std::ostringstream first_obj;
+    first_obj << "object " << big << " ";
+    assert(report.str().find("object ") == report.str().find(first_obj.str()));
+
+    delete big;
+
+    for(buffer* buf : small)
+        delete buf;
+
+    assert(check.live_bytes() == 0);
+}
+
+// objects created and destroyed between two snapshots, per construction site
+void test_snapshots()
+{
+    memcheck<buffer>& check = memcheck<buffer>::get();
+    std::vector<buffer*> small;
+
+    for(int i = 0; i < 10; ++i)
+        small.push_back(new buffer(16));
+
+    memcheck<buffer>::snapshot_type before = check.snapshot();
+
+    delete small.back();
+    small.pop_back();
+    buffer* big = create_big_buffer();
+
+    memcheck<buffer>::snapshot_type after = check.snapshot();
+    std::vector<memcheck_site_diff> sites = check.diff(before, after);
+
+    // the big buffer grows the most
+    assert(sites.size() == 2);
+    assert(sites[0].added == 1 && sites[0].removed == 0);
+    assert(sites[0].added_bytes == (1 << 20) + sizeof(buffer));
+    assert(sites[1].added == 0 && sites[1].removed == 1);
+    assert(check.diff(after, after).empty());
+
+    check.show_diff(before, after);
+
+    delete big;
+
+    for(buffer* buf : small)
+        delete buf;
+}
+
+// lifetime events written to a binary log and read back
+void test_stream()
+{
+    const char* path = "/tmp/memcheck_test.log";
+    memcheck<long>& check = memcheck<long>::get();
+    event_stream stream;
+    long objs[3];
+
+    assert(stream.open(path));
+    check.set_storage(memcheck<long>::storage::stream);
+    check.set_stream(&stream);
+
+    for(long& obj : objs)
+        check.created(&obj);
+
+    for(long& obj : objs)
+        check.destroyed(&obj);
+
+    // nothing is kept in the process
+    assert(check.registered_count() == 0);
+    check.set_stream(nullptr);
+    stream.close();
+
+    std::ifstream in(path);
+    event_stream_reader reader(in);
+    event_stream_reader::event ev;
+    int created = 0, destroyed = 0;
+    assert(reader.valid());
+
+    while(reader.next(ev))
+    {
+        assert(reader.types().at(ev.data.type) == "long");
+        assert(reader.traces().count(ev.data.trace));
+        assert(ev.data.thread == event_stream::thread_id());
+
+        if(ev.created)
+        {
+            assert(ev.data.obj == reinterpret_cast<uintptr_t>(&objs[created]));
+            assert(ev.data.size == sizeof(long));
+            ++created;
+        }
+        else
+        {
+            ++destroyed;
+        }
+    }
+
+    assert(created == 3 && destroyed == 3);
+    assert(!reader.modules().empty());
+    unlink(path);
+}
+
+// a log analyzed by memcheck-analyze: objects destroyed before they were
+// created in the log existed when it started, they do not lower the peak
+void test_analyze()
+{
+    const char* path = "/tmp/memcheck_test.analyze.log";
+    memcheck<unsigned short>& check = memcheck<unsigned short>::get();
+    event_stream stream;
+    unsigned short existing[5], objs[8];
+
+    assert(stream.open(path));
+    check.set_storage(memcheck<unsigned short>::storage::stream);
+    check.set_stream(&stream);
+
+    for(unsigned short& obj : existing)
+        check.destroyed(&obj);
+
+    for(unsigned short& obj : objs)
+        check.created(&obj);
+
+    for(int i = 0; i < 3; ++i)
+        check.destroyed(&objs[i]);
+
+    check.set_stream(nullptr);
+    stream.close();
+
+    std::string cmd = std::string("./memcheck-analyze -j 2 ") + path;
+    FILE* out = popen(cmd.c_str(), "r");
+    assert(out);
+
+    char line[4096];
+    unsigned long created = 0, destroyed = 0, live = 0, bytes = 0, peak = 0, unmatched = 0;
+    bool found_counts = false;
+
+    while(fgets(line, sizeof(line), out))
+    {
+        if(sscanf(line, "created %lu, destroyed %lu, existing %lu (%lu bytes), peak %lu",
+                    &created, &destroyed, &live, &bytes, &peak) == 5)
+            found_counts = true;
+
+        if(strstr(line, "destroyed objects were not created in the log"))
+            unmatched = strtoul(line, nullptr, 10);
+    }
+
+    assert(pclose(out) == 0);
+    std::cout << "analyzed log: created " << created << ", destroyed " << destroyed
+              << ", existing " << live << ", peak " << peak << std::endl;
+    assert(found_counts);
+    assert(created == 8 && destroyed == 8 && live == 5 && bytes == 5 * sizeof(unsigned short));
+    assert(peak == 8 && unmatched == 5);
+    unlink(path);
+}
+
+// objects existing in the crash registry are read back from the file,
+// while it is still mapped and after the process has been killed
+void test_mapped_registry()
 {
+    const char* path = "/tmp/memcheck_test.map";
+    memcheck<short>& check = memcheck<short>::get();
+    mapped_registry registry;
+    short objs[3];
+
+    assert(registry.open(path, 16, 1 << 20));
+    check.set_mapped_registry(&registry);
+
+    for(short& obj : objs)
+        check.created(&obj);
+
+    check.destroyed(&objs[1]);
+
+    // the file is read while the registry is still mapped,
+    // as it would be after a crash
+    mapped_registry_reader reader(path);
+    assert(reader.valid());
+    assert(reader.pid() == uint64_t(getpid()));
+    assert(reader.objects().size() == 2);
+
+    for(const auto& obj : reader.objects())
+    {
+        assert(obj.obj == reinterpret_cast<uintptr_t>(&objs[0])
+                || obj.obj == reinterpret_cast<uintptr_t>(&objs[2]));
+        assert(obj.size == sizeof(short));
+        assert(reader.records().types().at(obj.type) == "short");
+        assert(!reader.records().traces().at(obj.trace).empty());
+    }
+
+    assert(!reader.records().modules().empty());
+
+    check.destroyed(&objs[0]);
+    check.destroyed(&objs[2]);
+    check.set_mapped_registry(nullptr);
+    registry.close();
+
+    assert(mapped_registry_reader(path).objects().empty());
+
+    // a child process aborts with objects registered, they are found in the
+    // file and listed by memcheck-postmortem; the child has the same address
+    // space layout, so it registers the addresses of objs
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if(pid == 0)
+    {
+        struct rlimit no_core = { 0, 0 };
+        setrlimit(RLIMIT_CORE, &no_core);
+
+        if(!registry.open(path, 16, 1 << 20))
+            _exit(1);
+
+        check.set_mapped_registry(&registry);
+
+        for(short& obj : objs)
+            check.created(&obj);
+
+        check.destroyed(&objs[0]);
+        abort();
+    }
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+    mapped_registry_reader crashed(path);
+    assert(crashed.valid() && crashed.pid() == uint64_t(pid));
+    assert(crashed.objects().size() == 2);
+
+    for(const auto& obj : crashed.objects())
+    {
+        assert(obj.obj == reinterpret_cast<uintptr_t>(&objs[1])
+                || obj.obj == reinterpret_cast<uintptr_t>(&objs[2]));
+        assert(!crashed.records().traces().at(obj.trace).empty());
+    }
+
+    std::string cmd = std::string("./memcheck-postmortem ") + path;
+    FILE* out = popen(cmd.c_str(), "r");
+    char line[4096];
+    bool found_summary = false;
+    assert(out);
+
+    while(fgets(line, sizeof(line), out))
+        found_summary |= std::string(line) == "process " + std::to_string(pid) + ": 2 existing objects\n";
+
+    assert(pclose(out) == 0 && found_summary);
+    unlink(path);
+}
+
+static void leak_unsigned(std::vector<unsigned>& objs)
+{
+    for(unsigned& obj : objs)
+        memcheck<unsigned>::get().created(&obj);
+}
+
+// objects still existing are grouped by creation site, with a few examples
+void test_leaks()
+{
+    memcheck<unsigned>& check = memcheck<unsigned>::get();
+    std::vector<unsigned> many(50), few(2);
+    leak_unsigned(many);
+    leak_unsigned(few);
+
+    std::ostringstream out;
+    std::streambuf* cout_buf = std::cout.rdbuf(out.rdbuf());
+    check.show_leaks(2);
+    std::cout.rdbuf(cout_buf);
+    std::string text = out.str();
+
+    // one line and stack trace per site, the biggest one first
+    size_t first = text.find("200 bytes in 50 objects created at (e.g. ");
+    size_t second = text.find("8 bytes in 2 objects created at (e.g. ");
+    assert(text.find("leaks of unsigned int: 52 objects, 208 bytes") == 0);
+    assert(first != std::string::npos && second != std::string::npos && first < second);
+
+    // two examples per site
+    std::string line = text.substr(first, text.find('\n', first) - first);
+    assert(std::count(line.begin(), line.end(), ',') == 1);
+
+    for(unsigned& obj : many)
+        check.destroyed(&obj);
+
+    for(unsigned& obj : few)
+        check.destroyed(&obj);
+}
+
+// reports queued for the writer thread, dropped when the queue is full
+// in drop mode, and not lost when the writer stops meanwhile
+void test_report_writer()
+{
+    const char* path = "/tmp/memcheck_test.out";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    report_writer& writer = report_writer::get();
+    std::atomic<bool> taken(false), hold(true);
+    assert(fd >= 0);
+
+    writer.start(fd, 4, report_writer::overflow::drop);
+
+    // the first message holds the writer, so the queue fills up
+    writer.send(report_writer::message([&](std::ostream& out) {
+        taken = true;
+
+        while(hold)
+            std::this_thread::yield();
+
+        out << "first\n";
+    }));
+
+    while(!taken)
+        std::this_thread::yield();
+
+    for(int i = 0; i < 4; ++i)
+        assert(writer.send(std::string("queued\n")));
+
+    assert(!writer.send(std::string("dropped\n")));
+    assert(writer.dropped() == 1);
+    hold = false;
+    writer.flush();
+
+    // reports are formatted by the writer thread
+    memcheck<short>& check = memcheck<short>::get();
+    short obj;
+    check.created(&obj);
+    check.show_create(&obj);
+    check.destroyed(&obj);
+
+    writer.flush();
+    writer.stop();
+    close(fd);
+
+    std::ifstream in(path);
+    std::stringstream out;
+    out << in.rdbuf();
+    std::string text = out.str();
+
+    assert(text.find("first\nqueued\nqueued\nqueued\nqueued\n") == 0);
+    assert(text.find("dropped") == std::string::npos);
+    assert(text.find("construction stack trace for") != std::string::npos);
+    assert(writer.written_bytes() == text.size());
+
+    // messages accepted while the writer stops are written too; the queue
+    // is small, so the senders keep waiting for room
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    writer.start(fd, 8, report_writer::overflow::block);
+    std::atomic<bool> sending(true);
+    std::atomic<size_t> accepted(0);
+    std::vector<std::thread> senders;
+
+    for(int i = 0; i < 4; ++i)
+    {
+        senders.emplace_back([&]() {
+            while(sending)
+            {
+                if(writer.send(std::string("line\n")))
+                    ++accepted;
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writer.stop();
+    sending = false;
+
+    for(std::thread& th : senders)
+        th.join();
+
+    close(fd);
+    std::ifstream lines(path);
+    std::string line;
+    size_t written = 0;
+
+    while(std::getline(lines, line))
+        ++written;
+
+    std::cout << "messages sent while stopping the writer: " << accepted
+              << ", written " << written << std::endl;
+    assert(written == accepted && writer.waited() > 0);
+    unlink(path);
+}
+
+// run by test_preload with the preloaded library, prints the blocks that
+// should exist at exit: the moved one, and the one that failed to grow
+static int realloc_blocks()
+{
+    volatile size_t huge = SIZE_MAX / 2;
+    void* moved = realloc(malloc(16), 1 << 20);
+    void* released = malloc(32);
+    void* kept = malloc(48);
+
+    assert(realloc(released, 0) == nullptr);
+    assert(realloc(kept, huge) == nullptr);
+
+    std::cout << moved << " " << kept << std::endl;
+    return 0;
+}
+
+// heap blocks of a program resized with realloc(), reported by the preloaded
+// library at exit and written to MEMCHECK_DUMP
+void test_preload(const char* exe)
+{
+    std::string out = "/tmp/memcheck_test." + std::to_string(getpid());
+    std::string cmd = "LD_PRELOAD=./libmemcheck_preload.so MEMCHECK_SAMPLE_BYTES=1 MEMCHECK_DUMP="
+        + out + ".dump " + exe + " realloc > " + out + ".out 2> " + out + ".err";
+    assert(system(cmd.c_str()) == 0);
+
+    std::string moved, kept;
+    std::ifstream(out + ".out") >> moved >> kept;
+
+    // the summary counts all sampled blocks of the program
+    std::ifstream err(out + ".err");
+    std::string summary;
+
+    while(std::getline(err, summary) && summary.find("memcheck: ") != 0)
+        ;
+
+    std::cout << summary << std::endl;
+    size_t count = 0, bytes = 0;
+    assert(sscanf(summary.c_str(), "memcheck: %zu sampled heap blocks exist, %zu bytes", &count, &bytes) == 2);
+    assert(count >= 2 && bytes >= (1 << 20) + 48);
+
+    std::ifstream dump(out + ".dump");
+    std::string line;
+    bool found_moved = false, found_kept = false;
+
+    while(std::getline(dump, line))
+    {
+        found_moved |= line.find("object " + moved + " ") == 0 && line.rfind(" 1048576") == line.size() - 8;
+        found_kept |= line.find("object " + kept + " ") == 0 && line.rfind(" 48") == line.size() - 3;
+    }
+
+    assert(found_moved && found_kept);
+    unlink((out + ".out").c_str());
+    unlink((out + ".err").c_str());
+    unlink((out + ".dump").c_str());
+}
+
+// raw report of the existing foo objects, symbolized by memcheck-symbolize;
+// the objects were created in main()
+void test_symbolize()
+{
+    const char* path = "/tmp/memcheck_test.dump";
+
+    {
+        std::ofstream report(path);
+        memcheck<foo>::get().dump(report);
+    }
+
+    std::string cmd = std::string("./memcheck-symbolize ") + path;
+    FILE* out = popen(cmd.c_str(), "r");
+    assert(out);
+
+    char line[4096];
+    size_t objects = 0, in_main = 0;
+
+    while(fgets(line, sizeof(line), out))
+    {
+        if(strstr(line, "construction stack trace for ") == line)
+            ++objects;
+
+        if(strstr(line, "] main in "))
+            ++in_main;
+    }
+
+    assert(pclose(out) == 0);
+    std::cout << "symbolized " << objects << " objects, " << in_main
+              << " frames in main" << std::endl;
+    assert(objects > 0 && in_main > 0);
+    unlink(path);
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1 && strcmp(argv[1], "realloc") == 0)
+        return realloc_blocks();
+
     foo* a;             // uninitialized on purpose
     foo* b = nullptr;   // this one will be leaked
 
@@ -82,9 +1131,68 @@ int main()
     memcheck<foo>::get().show_destroy(a);
     std::cout << std::endl;
 
+    // frames are resolved to functions and source lines using the symbol
+    // table and debug information, no need to export symbols (-rdynamic)
+    bool found_main = false, found_line = false;
+    call_stack st;
+
+    for(const call_stack::frame& fr : st)
+    {
+        if(strcmp(fr.function(), "main") == 0)
+            found_main = true;
+
+        if(strstr(fr.source_file(), "memcheck_test.cpp") && fr.line_number() > 0)
+            found_line = true;
+    }
+
+    assert(found_main);
+    assert(found_line);
+
+    // both traces share most of the frames, they are resolved only once
+    std::cout << "symbol cache: " << symbol_cache::get().hits() << " hits, "
+              << symbol_cache::get().misses() << " misses" << std::endl;
+    assert(symbol_cache::get().hits() > 0);
+    std::cout << std::endl;
+
+    churn_foo();
+    assert(memcheck<foo>::get().exists(b) == true);
+
+    // thousands of objects, but only a few distinct places
+    // where they were created and destroyed
+    std::cout << "distinct stack traces: " << trace_store::get().size() << std::endl;
+    assert(trace_store::get().size() < 10);
+
+    test_unwinders();
+    test_modules();
+    test_inlined();
+    test_sampling();
+    test_threads();
+    test_event_log();
+    test_retention();
+    test_generations();
+    test_policies();
+    test_switch();
+    test_tracked();
+    test_bytes();
+    test_snapshots();
+    test_stream();
+    test_analyze();
+    test_mapped_registry();
+    test_leaks();
+    test_report_writer();
+    test_preload(argv[0]);
+
     // show all valid objects of 'foo' type
     memcheck<foo>::get().show_objs();
     std::cout << std::endl;
 
+    // do not resolve symbols in the process, show module offsets instead
+    call_stack::set_symbolize(false);
+    memcheck<foo>::get().show_create(b);
+    call_stack::set_symbolize(true);
+    std::cout << std::endl;
+
+    test_symbolize();
+
     return 0;
 }